@@ -13,8 +13,24 @@
 // limitations under the License.
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pspinsim.h"
 #include "../generic_driver/gdriver.h"
 #include "packets.h"
+#include "../handlers/ar_multi_sparse.h"
+
+#if RUNTIME_CONFIG
+// The handler may be built for larger values, it reads the ones of this run from the start of L2
+static AllreduceConfig ar_config = {
+    .magic = AR_CONFIG_MAGIC,
+    .num_children = RUN_SWITCH_PORTS,
+    .block_range = RUN_BLOCK_RANGE,
+    .hash_size = RUN_HASH_SIZE,
+    .dense_output_threshold = DENSE_OUTPUT_THRESHOLD,
+    .flags = (DENSE_OUTPUT ? AR_CFG_DENSE_OUTPUT : 0) | (DROP_DUPLICATES ? AR_CFG_DROP_DUPLICATES : 0)
+};
+#endif
 
 
 int main(int argc, char**argv)
@@ -25,6 +41,15 @@ int main(int argc, char**argv)
     const char *th=NULL;
 
     gdriver_init(argc, argv, handlers_file, hh, ph, th);
+    // The slots that spill to L2 and the stats start zeroed like the scratchpad, so they are part of the image
+    size_t l2_img_size = AR_L2_HEAD + AR_SLOT_STRIDE*AR_L2_SLOTS*NUM_CLUSTERS;
+    if(l2_img_size > 0){
+        uint8_t* l2_img = calloc(1, l2_img_size);
+#if RUNTIME_CONFIG
+        memcpy(l2_img, &ar_config, sizeof(ar_config));
+#endif
+        gdriver_set_l2_img(l2_img, l2_img_size);
+    }
 
     gdriver_run();
 
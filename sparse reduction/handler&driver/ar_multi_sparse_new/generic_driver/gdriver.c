@@ -32,14 +32,12 @@
 
 #define SLM_FILES "build/slm_files/"
 
-#define NIC_L2_ADDR 0x1c300000
-#define NIC_L2_SIZE (1024 * 1024)
+#define NIC_L2_ADDR 0x1c300000 // NIC_L2_SIZE comes with the handler header, which places slots in it
 
 #define HOST_ADDR 0xdeadbeefdeadbeef
 #define HOST_SIZE (1024 * 1024 * 1024)
 
 #define SCRATCHPAD_REL_ADDR 0
-#define SCRATCHPAD_SIZE (800 * 1024)
 
 #define CHECK_ERR(S)                   \
     {                                  \
@@ -53,6 +51,23 @@
     #define NUM_STREAMS 1
 #endif
 
+// Delays every block of one port, to exercise STRAGGLER_TIMEOUT
+#ifndef STRAGGLER_PORT
+    #define STRAGGLER_PORT 0
+#endif
+
+#ifndef STRAGGLER_DELAY
+    #define STRAGGLER_DELAY 0
+#endif
+
+// Percentage of packets sent twice, as a retransmission would, to exercise the duplicate detection
+#ifndef DUPLICATE_PERCENT
+    #define DUPLICATE_PERCENT 0
+#endif
+#if DUPLICATE_PERCENT > 0 && !DROP_DUPLICATES
+    #error "DUPLICATE_PERCENT needs a handler built with DROP_DUPLICATES"
+#endif
+
 typedef struct {
     uint32_t msgid; 
     uint8_t pkt_data[PKT_SIZE];
@@ -63,17 +78,122 @@ typedef struct {
     uint64_t user_ptr;
 }PacketInfo;
 
+// Packets a port sends for one block: the expected nonzeros plus some margin (one more per slice), and with
+// INDEX_TYPE_BASE16 one more per 64K window the block spans
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+#define MAX_PKTS_PER_BLOCK ((RUN_BLOCK_RANGE / RUN_NONZERO_RATIO) / MAX_DATA_ELEMENTS + RUN_BLOCK_RANGE / AR_BASE_WINDOW + AR_SLICES + 1)
+#else
+#define MAX_PKTS_PER_BLOCK ((RUN_BLOCK_RANGE / RUN_NONZERO_RATIO) / MAX_DATA_ELEMENTS + AR_SLICES + 1)
+#endif
+#ifdef TRACE_IN
+// A child of an upper level carries the union of the nonzeros below it, up to the whole block. This is only where
+// the packets of a stream start, with hash storage the stash overflows at the upper levels and sends many more.
+#undef MAX_PKTS_PER_BLOCK
+#define MAX_PKTS_PER_BLOCK (RUN_BLOCK_RANGE / MAX_DATA_ELEMENTS + AR_SLICES + 1)
+#endif
+
+// Every slice of a block is a message of its own, with CLUSTER_SPLIT slice s goes to cluster s
+#define AR_MSGID(stream_id, id, slice) ((NUM_BLOCKS * (stream_id) + (id)) * AR_SLICES + (slice))
+#define AR_SLICE_START(slice) AR_SLICE_CLAMP((slice) * ((RUN_BLOCK_RANGE + AR_SLICES - 1) / AR_SLICES))
+#define AR_SLICE_CLAMP(i) ((i) < RUN_BLOCK_RANGE ? (i) : RUN_BLOCK_RANGE)
+
+#ifdef TRACE_DOWN
+// The parent sends every block down once, up to the whole block
+#define MAX_STREAM_PKTS (MAX_PKTS_PER_BLOCK * RUN_SWITCH_PORTS * NUM_BLOCKS + (RUN_BLOCK_RANGE / MAX_DATA_ELEMENTS + 1) * NUM_BLOCKS)
+#else
+#define MAX_STREAM_PKTS (MAX_PKTS_PER_BLOCK * RUN_SWITCH_PORTS * NUM_BLOCKS)
+#endif
+
 typedef struct {
     uint32_t size;
-    PacketInfo pkts[2 * NUM_SWITCH_PORTS * NUM_BLOCKS]
+    uint32_t capacity; // Starts at MAX_STREAM_PKTS, doubled whenever it is reached
+    PacketInfo* pkts;
 }StreamInfo;
 
-static uint32_t send_time_per_port[NUM_STREAMS][NUM_SWITCH_PORTS][NUM_BLOCKS];
-static uint32_t sent[NUM_STREAMS][NUM_BLOCKS];
-static uint32_t sent_flag[NUM_STREAMS][NUM_SWITCH_PORTS][NUM_BLOCKS];
+static uint32_t send_time_per_port[NUM_STREAMS][RUN_SWITCH_PORTS][NUM_BLOCKS];
+static uint32_t sent[NUM_STREAMS][NUM_BLOCKS][AR_SLICES]; // Ports done with each slice of a block
+static uint32_t sent_flag[NUM_STREAMS][RUN_SWITCH_PORTS][NUM_BLOCKS];
 static StreamInfo stream[NUM_STREAMS];
+static uint32_t duplicates[NUM_STREAMS];
+#if ROOT_MODE
+// Reduced blocks written by the root, NUM_BLOCKS * RUN_BLOCK_RANGE values per stream
+static AR_TYPE_NAME* root_result;
+// Bitmap of the blocks written, with CLUSTER_SPLIT of their slices, which are written on their own
+#define ROOT_WRITES (NUM_STREAMS * NUM_BLOCKS * AR_SLICES)
+static uint32_t root_written[(ROOT_WRITES + 31) / 32];
+#define ROOT_STREAM_ADDRESS(stream_id) (AR_ROOT_HOST_OFFSET + (stream_id) * NUM_BLOCKS * AR_ROOT_BLOCK_BYTES)
+#endif
+// What the hosts sent, summed per index like the blocks written by the root
+static uint32_t* host_sum;
+
+// Level of the reduction tree simulated by this run. Level 0 takes generated host data, an upper level replays the
+// output of the level below from the TRACE_IN file, and with TRACE_OUT the output of this level is saved for the next.
+#ifndef TREE_LEVEL
+    #define TREE_LEVEL 0
+#endif
+
+// With BCAST_ROOT the trace holds the blocks sent down, once each, which the level below replays with TRACE_DOWN
+// after its own traffic as if they came from its parent. It has to be a BCAST_FORWARD level to pass them on.
+#if defined(TRACE_DOWN) && BCAST != BCAST_FORWARD
+    #error "TRACE_DOWN replays the blocks of the parent, only BCAST_FORWARD sends them on to the children"
+#endif
+// Blocks coming down take message ids after the ones of the blocks going up
+#define AR_MSGID_DOWN(stream_id, id) (NUM_STREAMS * NUM_BLOCKS * AR_SLICES + NUM_BLOCKS * (stream_id) + (id))
+
+#if defined(TRACE_IN) || defined(TRACE_OUT) || defined(TRACE_DOWN)
+// A packet leaving a switch, time is the cycle of the last handler feedback before it
+typedef struct {
+    uint64_t time;
+    uint32_t len;
+    uint8_t data[PKT_SIZE];
+} TraceRecord;
+#endif
+#ifdef TRACE_OUT
+static FILE* trace_out;
+#endif
+
+// What went in and out of this switch and when, reported per tree level
+static uint32_t tree_in_pkts, tree_out_pkts;
+static uint64_t tree_in_bytes, tree_out_bytes;
+static uint64_t tree_first_arrival = UINT64_MAX, tree_last_feedback;
+#if REDUCE_SCATTER
+// Egress of each port, which only gets its shard of every block
+static uint32_t port_out_pkts[RUN_SWITCH_PORTS];
+static uint64_t port_out_bytes[RUN_SWITCH_PORTS];
+#endif
+#if COALESCE_OUTPUT
+static uint32_t coalesced_pkts, coalesced_segments; // Out packets that are AR_FLAG_COALESCED, and the packets they carry
+#endif
+#if !ROOT_MODE
+// What the switch sent to the parent, checked by gdriver_fini: the values summed per index like host_sum, and for
+// each block (with REDUCE_SCATTER each shard) its packets, its closing packets and the count the last one carried
+#define OUT_SHARDS (REDUCE_SCATTER ? RUN_SWITCH_PORTS : 1)
+static AR_TYPE_NAME* out_sum;
+static uint32_t out_pkts[NUM_STREAMS * NUM_BLOCKS * OUT_SHARDS];
+static uint32_t out_closes[NUM_STREAMS * NUM_BLOCKS * OUT_SHARDS];
+static uint32_t out_split[NUM_STREAMS * NUM_BLOCKS * OUT_SHARDS];
+static uint32_t out_values[NUM_STREAMS * NUM_BLOCKS]; // Values sent of each block, for TOPK_ELEMENTS
+static uint32_t out_misplaced; // Values out of their block, of the shard of their port, or of the slice of their packet
+#endif
+#ifdef TRACE_DOWN
+static uint32_t down_in_pkts, down_out_pkts; // Packets of the parent, and their copies sent to the children
+#endif
+
+#if BCAST != BCAST_NONE
+// First arrival and last handler feedback of every block, its packets carry stream_id * NUM_BLOCKS + id + 1 as user_ptr
+static uint64_t block_first_arrival[NUM_STREAMS * NUM_BLOCKS];
+static uint64_t block_last_feedback[NUM_STREAMS * NUM_BLOCKS];
+#endif
 
 int save_packet(size_t stream_id, uint32_t msgid, uint8_t* pkt_data, size_t pkt_len, size_t pkt_l1_len, uint8_t eom, uint32_t wait_cycles, uint64_t user_ptr) {
+    if(stream[stream_id].size == stream[stream_id].capacity){
+        stream[stream_id].capacity = stream[stream_id].capacity ? 2 * stream[stream_id].capacity : MAX_STREAM_PKTS;
+        stream[stream_id].pkts = realloc(stream[stream_id].pkts, stream[stream_id].capacity * sizeof(PacketInfo));
+        if(stream[stream_id].pkts == NULL){
+            printf("Stream %ld: cannot hold %u packets\n", stream_id, stream[stream_id].capacity);
+            exit(1);
+        }
+    }
     stream[stream_id].pkts[stream[stream_id].size].msgid = msgid;
     stream[stream_id].pkts[stream[stream_id].size].pkt_len = pkt_len;
     stream[stream_id].pkts[stream[stream_id].size].pkt_l1_len = pkt_l1_len;
@@ -84,8 +204,234 @@ int save_packet(size_t stream_id, uint32_t msgid, uint8_t* pkt_data, size_t pkt_
     ++stream[stream_id].size;
     return 0;
 }
+
+// Saves the packet, followed by a copy of it DUPLICATE_PERCENT of the times (the copy takes the end of message)
+static int save_packet_dup(size_t stream_id, uint32_t msgid, uint8_t* pkt_data, size_t pkt_len, uint8_t eom, uint32_t wait_cycles){
+    uint64_t block = msgid / AR_SLICES + 1;
+#if DUPLICATE_PERCENT > 0
+    if(rand() % 100 < DUPLICATE_PERCENT){
+        ++duplicates[stream_id];
+        save_packet(stream_id, msgid, pkt_data, pkt_len, pkt_len, 0, wait_cycles, block);
+        return save_packet(stream_id, msgid, pkt_data, pkt_len, pkt_len, eom, 0, block);
+    }
+#endif
+    return save_packet(stream_id, msgid, pkt_data, pkt_len, pkt_len, eom, wait_cycles, block);
+}
+// Number of packets the nonzeros of [start, end) of a block are split in
+static int count_chunks(const uint8_t* nonzero, size_t start, size_t end){
+    int chunks = 0;
+    size_t j = 0;
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+    size_t base = 0;
+#endif
+    for(size_t i = start; i < end; i++){
+        if(nonzero[i]){
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+            if(j && i - base >= AR_BASE_WINDOW){
+                ++chunks;
+                j = 0;
+            }
+            if(j == 0){
+                base = i;
+            }
+#endif
+            if(++j == MAX_DATA_ELEMENTS){
+                ++chunks;
+                j = 0;
+            }
+        }
+    }
+    return chunks + (j ? 1 : 0);
+}
+
+// Saves the first num_values elements of pkt as the next chunk of its slice of the block, the last chunk carries the
+// number of chunks
+static void save_chunk(size_t stream_id, uint8_t* pkt_buffer, size_t num_values, uint32_t port, uint32_t slice, int block_split_num, int* chunks_sent, uint32_t* interarrival){
+    AllreducePacket* pkt = (AllreducePacket*) (pkt_buffer + SIZE_IP_UDP_HDRS);
+    pkt->hdr.num_values = num_values;
+    pkt->hdr.port = port;
+    pkt->hdr.block_split_num = (*chunks_sent + 1 == block_split_num) ? block_split_num : 0;
+    pkt->hdr.seq = *chunks_sent;
+    if(*chunks_sent){
+        *interarrival = 0;
+    }
+    ++*chunks_sent;
+    // Only send the elements that are there (indices moved next to the values), padded to the NIC granularity
+    AR_PKT_COMPACT(pkt);
+    size_t pkt_len = AR_WIRE_LEN(AR_PKT_LEN(num_values));
+    //printf("Sending only %d elements in %d bytes\n", num_values, pkt_len);
+    // (spin_ec_t* ec, uint32_t msgid, uint8_t* pkt_data, size_t pkt_len, size_t pkt_l1_len, uint8_t eom, uint32_t wait_cycles)
+    save_packet_dup(stream_id, AR_MSGID(stream_id, pkt->hdr.id, slice), pkt_buffer, pkt_len, sent[stream_id][pkt->hdr.id][slice] == RUN_SWITCH_PORTS && *chunks_sent == block_split_num, *interarrival);
+}
+
+#ifdef TRACE_IN
+// Packets each child sent so far for a slice of a block. The seq the level below left in its output is not a
+// sequence of the child, so the replay numbers the packets again.
+static uint32_t replay_seq[NUM_STREAMS][RUN_SWITCH_PORTS][NUM_BLOCKS][AR_SLICES];
+
+// Sends a packet of the trace for one slice of its block from every port
+static void replay_trace_packet(size_t stream_id, uint32_t slice, uint8_t* data, uint32_t len, uint32_t interarrival){
+    AllreducePacket* pkt = (AllreducePacket*) (data + SIZE_IP_UDP_HDRS);
+    uint32_t id = pkt->hdr.id;
+#if ROOT_MODE
+    pkt->hdr.root_address = ROOT_STREAM_ADDRESS(stream_id);
+#endif
+    for(uint32_t c = 0; c < RUN_SWITCH_PORTS; c++){
+        pkt->hdr.id = (id + NUM_BLOCKS - c % NUM_BLOCKS) % NUM_BLOCKS;
+        pkt->hdr.port = c;
+        pkt->hdr.seq = replay_seq[stream_id][c][pkt->hdr.id][slice]++;
+        pkt->hdr.rand = rand() % NUM_BUFFERS; // Buffer the handler waits for if all of them are busy
+        if(pkt->hdr.block_split_num){ // Last packet of the block (slice) from this child
+            sent[stream_id][pkt->hdr.id][slice]++;
+        }
+        save_packet_dup(stream_id, AR_MSGID(stream_id, pkt->hdr.id, slice), data, len, pkt->hdr.block_split_num && sent[stream_id][pkt->hdr.id][slice] == RUN_SWITCH_PORTS, c ? 0 : interarrival);
+    }
+}
+
+#if CLUSTER_SPLIT
+// Packets each slice of a block got so far from the trace. The level below closes a block with one packet,
+// whether it was split or not, so the replay closes every slice itself.
+static uint32_t trace_slice_pkts[NUM_STREAMS][NUM_BLOCKS][AR_SLICES];
+
+// Cuts a packet of the trace at the slice boundaries and sends each part as a packet that does not close its
+// slice. The closing packet of the trace then closes every slice with the number of packets it got.
+static void replay_trace_slices(size_t stream_id, uint8_t* data, uint32_t len, uint32_t interarrival){
+    AllreducePacket* pkt = (AllreducePacket*) (data + SIZE_IP_UDP_HDRS);
+    uint8_t part_buffer[PKT_SIZE] __attribute__((aligned(4)));
+    AllreducePacket* part = (AllreducePacket*) (part_buffer + SIZE_IP_UDP_HDRS);
+    uint32_t id = pkt->hdr.id;
+    for(uint32_t slice = 0; slice < AR_SLICES; slice++){
+        size_t start = AR_SLICE_START(slice);
+        size_t end = AR_SLICE_START(slice + 1);
+        uint32_t part_len;
+        memcpy(part_buffer, data, SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader));
+        part->hdr.block_split_num = 0;
+        if(pkt->hdr.flags & AR_FLAG_DENSE){
+            AllreduceDensePacket* dense = (AllreduceDensePacket*) pkt;
+            AllreduceDensePacket* dense_part = (AllreduceDensePacket*) part;
+            size_t lo = dense->start > start ? dense->start : start;
+            size_t hi = dense->start + dense->hdr.num_values < end ? dense->start + dense->hdr.num_values : end;
+            if(lo >= hi){
+                continue;
+            }
+            dense_part->start = lo;
+            dense_part->hdr.num_values = hi - lo;
+            memcpy(dense_part->data, dense->data + (lo - dense->start), (hi - lo) * sizeof(AR_TYPE_NAME));
+            part_len = AR_WIRE_LEN(AR_DENSE_PKT_LEN(hi - lo));
+        }else{
+            AR_INDEX_NAME* indexes = AR_PKT_INDEX(pkt);
+            uint32_t j = 0;
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+            part->base = pkt->base;
+#endif
+            for(uint32_t i = 0; i < pkt->hdr.num_values; i++){
+                size_t index = AR_BLOCK_INDEX(pkt, indexes[i]);
+                if(index >= start && index < end){
+                    part->index[j] = indexes[i];
+                    part->data[j++] = pkt->data[i];
+                }
+            }
+            if(!j){
+                continue;
+            }
+            part->hdr.num_values = j;
+            AR_PKT_COMPACT(part);
+            part_len = AR_WIRE_LEN(AR_PKT_LEN(j));
+        }
+        trace_slice_pkts[stream_id][id][slice]++;
+        replay_trace_packet(stream_id, slice, part_buffer, part_len, interarrival);
+        interarrival = 0;
+    }
+    if(pkt->hdr.block_split_num){
+        for(uint32_t slice = 0; slice < AR_SLICES; slice++){
+            memcpy(part_buffer, data, SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader));
+            part->hdr.flags &= ~AR_FLAG_DENSE;
+            part->hdr.num_values = 0;
+            part->hdr.block_split_num = ++trace_slice_pkts[stream_id][id][slice];
+            trace_slice_pkts[stream_id][id][slice] = 0;
+            replay_trace_packet(stream_id, slice, part_buffer, AR_WIRE_LEN(AR_PKT_LEN(0)), interarrival);
+            interarrival = 0;
+        }
+    }
+}
+#define REPLAY_TRACE(stream_id, data, len, interarrival) replay_trace_slices((stream_id), (data), (len), (interarrival))
+#else
+#define REPLAY_TRACE(stream_id, data, len, interarrival) replay_trace_packet((stream_id), 0, (data), (len), (interarrival))
+#endif
+
+// Replays the output of a switch of the level below on every port. Child c sends block id + c of the trace as
+// block id, so the children carry different nonzeros (as long as NUM_BLOCKS is at least the fan-in).
+static int prepare_trace_packets(size_t stream_id) {
+    FILE* f = fopen(TRACE_IN, "rb");
+    if(f == NULL){
+        printf("Cannot open trace %s\n", TRACE_IN);
+        exit(1);
+    }
+    TraceRecord rec;
+    AllreducePacket* pkt = (AllreducePacket*) (rec.data + SIZE_IP_UDP_HDRS);
+    uint64_t now = 0;
+    while(fread(&rec, sizeof(rec), 1, f) == 1){
+        if(pkt->hdr.coll_id != stream_id){
+            continue;
+        }
+        // The children of the level below finish at the same pace, their packets arrive together
+        uint32_t interarrival = rec.time - now;
+        now = rec.time;
+        if(!(pkt->hdr.flags & AR_FLAG_COALESCED)){
+            REPLAY_TRACE(stream_id, rec.data, rec.len, interarrival);
+            continue;
+        }
+        // The packets of the level below were coalesced, the children send them one by one
+        uint8_t segment[PKT_SIZE] __attribute__((aligned(4)));
+        uint32_t offset = SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader);
+        memcpy(segment, rec.data, SIZE_IP_UDP_HDRS);
+        for(uint32_t s = 0; s < pkt->hdr.num_values; s++){
+            AllreduceHeader* hdr = (AllreduceHeader*) (rec.data + offset);
+            uint32_t len = AR_SEGMENT_LEN(hdr);
+            memcpy(segment + SIZE_IP_UDP_HDRS, hdr, len);
+            REPLAY_TRACE(stream_id, segment, AR_WIRE_LEN(SIZE_IP_UDP_HDRS + len), s ? 0 : interarrival);
+            offset += len;
+        }
+    }
+    fclose(f);
+    printf("Stream %d: replayed %s on %d ports\n", stream_id, TRACE_IN, RUN_SWITCH_PORTS);
+#if DUPLICATE_PERCENT > 0
+    printf("Stream %d: %d duplicated packets\n", stream_id, duplicates[stream_id]);
+#endif
+    return 0;
+}
+#endif
+
+#ifdef TRACE_DOWN
+// Appends the blocks the parent sent down, as the switch of the level above wrote them
+static void prepare_down_packets(size_t stream_id){
+    FILE* f = fopen(TRACE_DOWN, "rb");
+    if(f == NULL){
+        printf("Cannot open trace %s\n", TRACE_DOWN);
+        exit(1);
+    }
+    TraceRecord rec;
+    AllreducePacket* pkt = (AllreducePacket*) (rec.data + SIZE_IP_UDP_HDRS);
+    uint64_t now = 0;
+    while(fread(&rec, sizeof(rec), 1, f) == 1){
+        if(pkt->hdr.coll_id != stream_id){
+            continue;
+        }
+        uint32_t interarrival = rec.time - now;
+        now = rec.time;
+        ++down_in_pkts;
+        save_packet(stream_id, AR_MSGID_DOWN(stream_id, pkt->hdr.id), rec.data, rec.len, rec.len, pkt->hdr.block_split_num != 0, interarrival, NUM_BLOCKS * stream_id + pkt->hdr.id + 1);
+    }
+    fclose(f);
+    printf("Stream %d: replayed %s from the parent\n", stream_id, TRACE_DOWN);
+}
+#endif
+
 //prepare packets for a single stream
 int prepare_packets(size_t stream_id) {
+#ifdef TRACE_IN
+    return prepare_trace_packets(stream_id);
+#endif
     SimpleSet indexes_set; // Set of distinct indexes
     set_init(&indexes_set);
     uint8_t pkt_buffer[PKT_SIZE];
@@ -94,7 +440,7 @@ int prepare_packets(size_t stream_id) {
     while(1){
         // Find next port from which sth is received
         uint32_t min_time = INT_MAX, min_port = INT_MAX, min_block = INT_MAX;
-        for (int j = 0; j < NUM_SWITCH_PORTS; j++){      
+        for (int j = 0; j < RUN_SWITCH_PORTS; j++){      
             // Still something to send for port j
             uint32_t nb = -1;
             uint32_t closest = INT_MAX;
@@ -125,85 +471,86 @@ int prepare_packets(size_t stream_id) {
             //printf("Sending packet of block %d on port %d after %d ns\n", min_block, min_port, interarrival);
             sent_flag[stream_id][min_port][min_block] = 1;
             pkt->hdr.id = min_block;
-            sent[stream_id][min_block]++;
+            pkt->hdr.flags = 0;
+            pkt->hdr.version = AR_PKT_VERSION;
+            pkt->hdr.coll_id = stream_id; // Each stream is an independent allreduce
+#if ROOT_MODE
+            pkt->hdr.root_address = ROOT_STREAM_ADDRESS(stream_id);
+#endif
+            pkt->hdr.rand = rand() % NUM_BUFFERS; // Buffer the handler waits for if all of them are busy
             //printf("Last for block %d %d\n", min_block, sent[min_block]);
             // Set stuff in the packet
-#if AR_TYPE == AR_TYPE_INT32
-            int32_t tmp_data[BLOCK_RANGE];  
-#elif AR_TYPE == AR_TYPE_INT16
-            int16_t tmp_data[BLOCK_RANGE];  
-#elif AR_TYPE == AR_TYPE_INT8
-            int8_t tmp_data[BLOCK_RANGE];  
-#elif AR_TYPE == AR_TYPE_FLOAT
-            float tmp_data[BLOCK_RANGE];  
-#endif
-            size_t nonzeros = 0;
-            for(size_t i = 0; i < BLOCK_RANGE; i++){
-                if((double)rand() / (double)RAND_MAX < 1.0/BLOCK_TO_NONZERO_RATIO){
+            // Static, large blocks would not fit on the stack
+            static uint8_t tmp_data[RUN_BLOCK_RANGE];
+            for(size_t i = 0; i < RUN_BLOCK_RANGE; i++){
+                if((double)rand() / (double)RAND_MAX < 1.0/RUN_NONZERO_RATIO){
                     tmp_data[i] = 1;
-                    ++nonzeros;
                 }else{
                     tmp_data[i] = 0;
                 }
             }
-            if(nonzeros == 0){ // TODO For the moment we assume there are not full-zero blocks                
-                tmp_data[0] = 1;
-                ++nonzeros;
-            }
 
-            int block_split_num = ceil((float)nonzeros/MAX_DATA_ELEMENTS);
-            int chunks_sent = 0;
-            //printf("block_split_num for block %d: %d (nonzeros %d)\n", pkt->hdr.id, block_split_num, nonzeros);
-            size_t j = 0;
-            for(size_t i = 0; i < BLOCK_RANGE; i++){
-                if(tmp_data[i]){
-                    pkt->index[j] = i;
-                    pkt->data[j]= 1;
-                    ++j;
+            // Each slice is closed on its own, by default the whole block is the only one
+            for(uint32_t slice = 0; slice < AR_SLICES; slice++){
+                size_t start = AR_SLICE_START(slice);
+                size_t end = AR_SLICE_START(slice + 1);
+                sent[stream_id][min_block][slice]++;
+                int block_split_num = count_chunks(tmp_data, start, end);
+                if(block_split_num == 0){
+                    // Empty block (slice), a header-only packet tells the switch this child is done
+                    pkt->hdr.num_values = 0;
+                    pkt->hdr.port = min_port;
+                    pkt->hdr.block_split_num = 1;
+                    pkt->hdr.seq = 0;
+                    save_packet_dup(stream_id, AR_MSGID(stream_id, pkt->hdr.id, slice), pkt_buffer, AR_WIRE_LEN(AR_PKT_LEN(0)), sent[stream_id][min_block][slice] == RUN_SWITCH_PORTS, interarrival);
+                    interarrival = 0;
+                    continue;
+                }
+#if DROP_DUPLICATES
+                if(block_split_num > MAX_CHUNKS_PER_PORT){
+                    printf("Block %d: %d packets per port, increase MAX_CHUNKS_PER_PORT\n", min_block, block_split_num);
+                    exit(1);
+                }
+#endif
+                int chunks_sent = 0;
+                //printf("block_split_num for block %d slice %d: %d\n", pkt->hdr.id, slice, block_split_num);
+                size_t j = 0;
+                for(size_t i = start; i < end; i++){
+                    if(tmp_data[i]){
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+                        if(j && i - pkt->base >= AR_BASE_WINDOW){
+                            // Out of the window of this packet, send it as it is
+                            save_chunk(stream_id, pkt_buffer, j, min_port, slice, block_split_num, &chunks_sent, &interarrival);
+                            j = 0;
+                        }
+                        if(j == 0){
+                            pkt->base = i;
+                        }
+                        pkt->index[j] = i - pkt->base;
+#else
+                        pkt->index[j] = i;
+#endif
+                        pkt->data[j]= 1;
+                        host_sum[(stream_id * NUM_BLOCKS + pkt->hdr.id) * RUN_BLOCK_RANGE + i] += 1;
+                        ++j;
                     
-                    // Add index to the set
-                    char str[16];
-                    sprintf(str, "%ld", ((long)BLOCK_RANGE)*pkt->hdr.id + i);
-                    set_add(&indexes_set, str);
-                    if(j == MAX_DATA_ELEMENTS){
-                        pkt->hdr.num_values = MAX_DATA_ELEMENTS;
-                        pkt->hdr.port = min_port;
-                        pkt->hdr.block_split_num = 0;
-                        if(chunks_sent){
-                            interarrival = 0;
+                        // Add index to the set
+                        char str[24];
+                        sprintf(str, "%ld", ((long)RUN_BLOCK_RANGE)*pkt->hdr.id + i);
+                        set_add(&indexes_set, str);
+                        if(j == MAX_DATA_ELEMENTS){
+                            save_chunk(stream_id, pkt_buffer, j, min_port, slice, block_split_num, &chunks_sent, &interarrival);
+                            j = 0;
                         }
-                        ++chunks_sent;
-                        // (spin_ec_t* ec, uint32_t msgid, uint8_t* pkt_data, size_t pkt_len, size_t pkt_l1_len, uint8_t eom, uint32_t wait_cycles)
-                        //pspinsim_packet_add(&ec, pkt->hdr.id, pkt_buffer, PKT_SIZE, PKT_SIZE, sent[min_block] == NUM_SWITCH_PORTS && chunks_sent == block_split_num, interarrival, 0x3);                        
-                        save_packet(stream_id, NUM_BLOCKS * stream_id + pkt->hdr.id, pkt_buffer, PKT_SIZE, PKT_SIZE, sent[stream_id][min_block] == NUM_SWITCH_PORTS && chunks_sent == block_split_num, interarrival, 0);
-                        j = 0;
+                    }else{
+                        // It is a zero element, so do nothing
                     }
-                }else{
-                    // It is a zero element, so do nothing
                 }
-            }
-            if(j){
-                pkt->hdr.num_values = j;
-                pkt->hdr.port = min_port;
-                pkt->hdr.block_split_num = block_split_num;
-                if(chunks_sent){
-                    interarrival = 0;
+                if(j){
+                    save_chunk(stream_id, pkt_buffer, j, min_port, slice, block_split_num, &chunks_sent, &interarrival);
+                    j = 0;
                 }
-                ++chunks_sent;
-		/*
-		int to_remove = (AR_TYPE_SIZE*(MAX_DATA_ELEMENTS - j));
-		while((PKT_SIZE - to_remove) % 64){
-		  to_remove -= 1;
-		}
-		assert((PKT_SIZE - to_remove) % 64 == 0);
-		*/
-		
-		int to_remove = 0;
-                //printf("Sending only %d elements Removing %d from packet size\n", j, AR_TYPE_SIZE*(MAX_DATA_ELEMENTS - j));
-                // (spin_ec_t* ec, uint32_t msgid, uint8_t* pkt_data, size_t pkt_len, size_t pkt_l1_len, uint8_t eom, uint32_t wait_cycles)
-                //pspinsim_packet_add(&ec, pkt->hdr.id, pkt_buffer, PKT_SIZE - to_remove, PKT_SIZE - to_remove, sent[min_block] == NUM_SWITCH_PORTS && chunks_sent == block_split_num, interarrival, 0x3);                
-                save_packet(stream_id, NUM_BLOCKS * stream_id + pkt->hdr.id, pkt_buffer, PKT_SIZE - to_remove, PKT_SIZE - to_remove, sent[stream_id][min_block] == NUM_SWITCH_PORTS && chunks_sent == block_split_num, interarrival, 0);
-                j = 0;
+                interarrival = 0; // The other slices follow right away
             }
         }
     }
@@ -211,6 +558,9 @@ int prepare_packets(size_t stream_id) {
     double num_packets = (distinct_indexes/(double)MAX_DATA_ELEMENTS);
     double num_bytes = num_packets*PKT_SIZE;
     printf("Stream %d :Prepare to send %ld distinct indexes. Min num packets %lf Min num bytes %lf\n ", stream_id, distinct_indexes, num_packets, num_bytes);
+#if DUPLICATE_PERCENT > 0
+    printf("Stream %d: %d duplicated packets\n", stream_id, duplicates[stream_id]);
+#endif
 }
 
 typedef struct sim_descr
@@ -335,6 +685,9 @@ void generate_packets()
 
     for(int i = 0; i < NUM_STREAMS; i++) {
         prepare_packets(i);
+#ifdef TRACE_DOWN
+        prepare_down_packets(i);
+#endif
     }
     //pick a stream to send
     int32_t next_stream = 0;
@@ -352,6 +705,8 @@ void generate_packets()
         uint32_t delay = next_pkt->wait_cycles + stream_time[next_stream] - global_time;
         printf("Stream %d: sending packet %d, delay %d, msgid %d, pkt_len %d, pkt_l1_len %d, eom %d \n", next_stream, packet_counter[next_stream], delay, next_pkt->msgid, next_pkt->pkt_len, next_pkt->pkt_l1_len, next_pkt->eom);
         pspinsim_packet_add(&(sim_state.ec), next_pkt->msgid, next_pkt->pkt_data, next_pkt->pkt_len, next_pkt->pkt_l1_len, next_pkt->eom, delay, next_pkt->user_ptr);
+        tree_in_pkts++;
+        tree_in_bytes += next_pkt->pkt_len;
         stream_time[next_stream] += next_pkt->wait_cycles;
         global_time = stream_time[next_stream];
         printf("Global time: %d\n", global_time);
@@ -385,9 +740,175 @@ void pcie_mst_write_complete(void *user_ptr)
     generate_packets();
 }
 
+#if AR_STATS
+static AllreduceStats cluster_stats[NUM_CLUSTERS];
+#endif
+#if PHASE_CYCLES
+static PhaseCycles hpu_cycles[NUM_CLUSTERS * AR_OUT_BUFFERS];
+#endif
+
+// DMA writes of the handlers: the counters of cluster i go to HOST_ADDR + i*sizeof(AllreduceStats), the cycles of
+// each HPU above AR_CYCLES_HOST_OFFSET and the blocks written by the root above AR_ROOT_HOST_OFFSET
+void host_write(uint64_t addr, uint8_t* data, size_t size)
+{
+    uint64_t offset = addr - HOST_ADDR;
+#if PHASE_CYCLES
+    if(offset >= AR_CYCLES_HOST_OFFSET && offset < AR_CYCLES_HOST_OFFSET + sizeof(hpu_cycles)){
+        uint64_t hpu = (offset - AR_CYCLES_HOST_OFFSET) / sizeof(PhaseCycles);
+        if(size == sizeof(PhaseCycles)){
+            memcpy(&hpu_cycles[hpu], data, size);
+        }
+        return;
+    }
+#endif
+#if ROOT_MODE
+    if(offset >= AR_ROOT_HOST_OFFSET){
+        uint64_t root_offset = offset - AR_ROOT_HOST_OFFSET;
+        if(root_offset + size <= NUM_STREAMS * NUM_BLOCKS * AR_ROOT_BLOCK_BYTES){
+            memcpy((uint8_t*) root_result + root_offset, data, size);
+            uint64_t w = root_offset / AR_ROOT_BLOCK_BYTES * AR_SLICES + (root_offset % AR_ROOT_BLOCK_BYTES) / sizeof(AR_TYPE_NAME) / ((RUN_BLOCK_RANGE + AR_SLICES - 1) / AR_SLICES);
+            root_written[w / 32] |= 1u << (w % 32);
+        }
+        return;
+    }
+#endif
+#if AR_STATS
+    uint64_t cluster = offset / sizeof(AllreduceStats);
+    if(cluster < NUM_CLUSTERS && size == sizeof(AllreduceStats)){
+        memcpy(&cluster_stats[cluster], data, size);
+    }
+#endif
+}
+
 void feedback(uint64_t user_ptr, uint64_t nic_arrival_time, uint64_t pspin_arrival_time, uint64_t feedback_time)
 {
     sim_state.packets_processed++;
+    if(nic_arrival_time < tree_first_arrival){
+        tree_first_arrival = nic_arrival_time;
+    }
+    if(feedback_time > tree_last_feedback){
+        tree_last_feedback = feedback_time;
+    }
+#if BCAST != BCAST_NONE
+    // The block is complete once the handler of its last packet, the one sending it down, is done
+    if(user_ptr){
+        uint32_t block = user_ptr - 1;
+        if(nic_arrival_time < block_first_arrival[block]){
+            block_first_arrival[block] = nic_arrival_time;
+        }
+        if(feedback_time > block_last_feedback[block]){
+            block_last_feedback[block] = feedback_time;
+        }
+    }
+#endif
+}
+
+#if !ROOT_MODE
+// Adds a packet sent to the parent to what gdriver_fini checks, a coalesced one segment by segment
+static void check_out_packet(AllreducePacket* ar){
+    if(ar->hdr.flags & AR_FLAG_COALESCED){
+        uint8_t* segment = (uint8_t*) ar + sizeof(AllreduceHeader);
+        for(uint32_t s = 0; s < ar->hdr.num_values; s++){
+            check_out_packet((AllreducePacket*) segment);
+            segment += AR_SEGMENT_LEN((AllreduceHeader*) segment);
+        }
+        return;
+    }
+#if BCAST == BCAST_ROOT
+    if(ar->hdr.port != 0){ // Every child gets the same block, it is checked once
+        return;
+    }
+#endif
+    if(ar->hdr.coll_id >= NUM_STREAMS || ar->hdr.id >= NUM_BLOCKS){
+        ++out_misplaced;
+        return;
+    }
+    uint32_t b = ar->hdr.coll_id * NUM_BLOCKS + ar->hdr.id;
+    AR_TYPE_NAME* sum = out_sum + (size_t) b * RUN_BLOCK_RANGE;
+    // Indices the packet may hold: the shard of its port with REDUCE_SCATTER, with CLUSTER_SPLIT the slice of its
+    // first index
+    uint32_t shard = REDUCE_SCATTER ? ar->hdr.port : 0;
+    size_t shard_size = (RUN_BLOCK_RANGE + OUT_SHARDS - 1) / OUT_SHARDS;
+    size_t lo = shard * shard_size, hi = lo + shard_size;
+    if(ar->hdr.flags & AR_FLAG_DENSE){
+        AllreduceDensePacket* dense = (AllreduceDensePacket*) ar;
+        if(dense->start < lo || dense->start + dense->hdr.num_values > hi || dense->start + dense->hdr.num_values > RUN_BLOCK_RANGE){
+            ++out_misplaced;
+        }else{
+            for(uint32_t i = 0; i < dense->hdr.num_values; i++){
+                sum[dense->start + i] += dense->data[i];
+            }
+        }
+    }else{
+        AR_INDEX_NAME* indexes = AR_PKT_INDEX(ar);
+#if CLUSTER_SPLIT
+        if(ar->hdr.num_values){
+            size_t slice_size = (RUN_BLOCK_RANGE + AR_SLICES - 1) / AR_SLICES;
+            lo = AR_BLOCK_INDEX(ar, indexes[0]) / slice_size * slice_size;
+            hi = lo + slice_size;
+        }
+#endif
+        for(uint32_t i = 0; i < ar->hdr.num_values; i++){
+            size_t index = AR_BLOCK_INDEX(ar, indexes[i]);
+            if(index < lo || index >= hi || index >= RUN_BLOCK_RANGE){
+                ++out_misplaced;
+            }else{
+                sum[index] += ar->data[i];
+            }
+        }
+    }
+    if(ar->hdr.flags & AR_FLAG_LATE){ // Not a packet of the flushed block, it only carries values
+        return;
+    }
+    out_values[b] += ar->hdr.num_values;
+    uint32_t k = b * OUT_SHARDS + shard;
+    out_pkts[k]++;
+    if(ar->hdr.block_split_num){
+        out_closes[k]++;
+        out_split[k] = ar->hdr.block_split_num;
+    }
+}
+#endif
+
+void pkt_out(uint8_t* data, size_t size)
+{
+#ifdef TRACE_DOWN
+    if(((AllreducePacket*) (data + SIZE_IP_UDP_HDRS))->hdr.flags & AR_FLAG_BCAST){ // A block of the parent going on down
+        ++down_out_pkts;
+        return;
+    }
+#endif
+    tree_out_pkts++;
+    tree_out_bytes += size;
+#if REDUCE_SCATTER
+    AllreducePacket* ar = (AllreducePacket*) (data + SIZE_IP_UDP_HDRS);
+    if(ar->hdr.port < RUN_SWITCH_PORTS){
+        port_out_pkts[ar->hdr.port]++;
+        port_out_bytes[ar->hdr.port] += size;
+    }
+#endif
+#if COALESCE_OUTPUT
+    AllreducePacket* out = (AllreducePacket*) (data + SIZE_IP_UDP_HDRS);
+    if(out->hdr.flags & AR_FLAG_COALESCED){
+        coalesced_pkts++;
+        coalesced_segments += out->hdr.num_values;
+    }
+#endif
+#if !ROOT_MODE
+    check_out_packet((AllreducePacket*) (data + SIZE_IP_UDP_HDRS));
+#endif
+#ifdef TRACE_OUT
+#if BCAST == BCAST_ROOT
+    if(((AllreducePacket*) (data + SIZE_IP_UDP_HDRS))->hdr.port != 0){ // Every child gets the same block, it is kept once
+        return;
+    }
+#endif
+    TraceRecord rec;
+    rec.time = tree_last_feedback;
+    rec.len = size;
+    memcpy(rec.data, data, size);
+    fwrite(&rec, sizeof(rec), 1, trace_out);
+#endif
 }
 
 /*** interface ***/
@@ -413,23 +934,58 @@ static double ran_expo(double mean){
     return -log(1- u) / lambda;
 }
 
+// Scratchpad map of a cluster: byte range and starting TCDM bank of each region
+static void print_layout(){
+    printf("LAYOUT locks      [%7lu, %7lu) bank %lu, stride %d words\n", (size_t) AR_L1_LOCKS_OFF, (size_t) AR_L1_OUT_OFF, (size_t) (AR_L1_LOCKS_OFF / 4) % TCDM_BANKS, LOCK_STRIDE);
+    printf("LAYOUT out bufs   [%7lu, %7lu) bank %lu, %d x %d bytes\n", (size_t) AR_L1_OUT_OFF, (size_t) AR_L1_CURSOR_OFF, (size_t) (AR_L1_OUT_OFF / 4) % TCDM_BANKS, AR_OUT_BUFFERS, PKT_SIZE);
+    if(SWEEP_CURSOR_SIZE > 0){
+        printf("LAYOUT cursor     [%7lu, %7lu) bank %lu\n", (size_t) AR_L1_CURSOR_OFF, (size_t) AR_L1_QUEUE_OFF, (size_t) (AR_L1_CURSOR_OFF / 4) % TCDM_BANKS);
+    }
+    if(FLUSH_QUEUE_SIZE > 0){
+        printf("LAYOUT flush queue[%7lu, %7lu) bank %lu\n", (size_t) AR_L1_QUEUE_OFF, (size_t) AR_L1_COALESCE_OFF, (size_t) (AR_L1_QUEUE_OFF / 4) % TCDM_BANKS);
+    }
+    if(COALESCER_SIZE > 0){
+        printf("LAYOUT coalescer  [%7lu, %7lu) bank %lu\n", (size_t) AR_L1_COALESCE_OFF, (size_t) AR_L1_HEAD, (size_t) (AR_L1_COALESCE_OFF / 4) % TCDM_BANKS);
+    }
+    for(size_t i = 0; i < AR_L1_SLOTS; i++){
+        size_t start = AR_L1_HEAD + AR_SLOT_STRIDE*i;
+        printf("LAYOUT slot %4lu  [%7lu, %7lu) bank %lu\n", i, start, start + AR_SLOT_STRIDE, (start / 4) % TCDM_BANKS);
+    }
+    printf("LAYOUT free       [%7lu, %7d)\n", (size_t) (AR_L1_HEAD + AR_SLOT_STRIDE*AR_L1_SLOTS), SCRATCHPAD_SIZE);
+}
+
 int gdriver_init(int argc, char **argv, const char *hfile, const char *hh, const char *ph, const char *th)
 {
-    printf("BLOCK RANGE %d\n", BLOCK_RANGE);
+    printf("BLOCK RANGE %d\n", RUN_BLOCK_RANGE);
+    // What the handlers keep in the scratchpad of each cluster (slot locks, one out buffer per HPU and the
+    // slots that fit) and in the L2 handler memory (configuration, stats and the slots that spill)
+    size_t l1_footprint = AR_L1_HEAD + AR_SLOT_STRIDE*AR_L1_SLOTS;
+    size_t l2_footprint = AR_L2_HEAD + AR_SLOT_STRIDE*AR_L2_SLOTS*NUM_CLUSTERS;
+    printf("L1 footprint per cluster: %lu bytes, %lu per slot, %d slots per collective\n", l1_footprint, sizeof(AllreduceInfo), COLL_SLOTS);
+    printf("Slots per cluster: %lu in L1, %lu in L2. L2 footprint: %lu bytes\n", (size_t) AR_L1_SLOTS, (size_t) AR_L2_SLOTS, l2_footprint);
+    print_layout();
+    if(l1_footprint > SCRATCHPAD_SIZE){
+        printf("The handler state does not fit in the %d bytes of scratchpad\n", SCRATCHPAD_SIZE);
+        exit(1);
+    }
+    if(l2_footprint > NIC_L2_SIZE){
+        printf("The spilled slots do not fit in the %d bytes of L2 handler memory\n", NIC_L2_SIZE);
+        exit(1);
+    }
     srand(time(NULL));
-    uint32_t mean_host_gbps = 400.0/NUM_SWITCH_PORTS;
+    double mean_host_gbps = 400.0/RUN_SWITCH_PORTS; // Not an integer, above 400 ports it is below 1
     uint32_t mean_host_interdeparture = (PKT_SIZE*8) / mean_host_gbps;
     for(size_t stream_idx = 0; stream_idx < NUM_STREAMS; stream_idx++) {
-        for(uint32_t i = 0; i < NUM_SWITCH_PORTS; i++){
-            uint32_t send_time = 0;
+        for(uint32_t i = 0; i < RUN_SWITCH_PORTS; i++){
+            uint32_t send_time = (i == STRAGGLER_PORT) ? STRAGGLER_DELAY : 0;
             uint32_t start_index = 0;
     #if STAGGERED_SENDING
-            double num_trains = NUM_BLOCKS/NUM_SWITCH_PORTS;
+            double num_trains = NUM_BLOCKS/RUN_SWITCH_PORTS;
             start_index = i*num_trains;
     #endif
             uint32_t k = 0;
             for(uint32_t j = start_index; k < NUM_BLOCKS; j = (j+1) % NUM_BLOCKS){
-                sent[stream_idx][j] = 0;
+                memset(sent[stream_idx][j], 0, sizeof(sent[stream_idx][j]));
                 sent_flag[stream_idx][i][j] = 0;
                 send_time_per_port[stream_idx][i][j] = send_time + ran_expo(mean_host_interdeparture);
                 send_time = send_time_per_port[stream_idx][i][j];
@@ -455,6 +1011,28 @@ int gdriver_init(int argc, char **argv, const char *hfile, const char *hh, const
 
     pspinsim_cb_set_pcie_mst_write_completion(pcie_mst_write_complete);
     pspinsim_cb_set_pkt_feedback(feedback);
+    pspinsim_cb_set_pkt_out(pkt_out);
+#ifdef TRACE_OUT
+    trace_out = fopen(TRACE_OUT, "wb");
+    if(trace_out == NULL){
+        printf("Cannot create trace %s\n", TRACE_OUT);
+        exit(1);
+    }
+#endif
+#if AR_STATS || ROOT_MODE || PHASE_CYCLES
+    pspinsim_cb_set_pcie_slv_write(host_write);
+#endif
+#if ROOT_MODE
+    root_result = calloc(NUM_STREAMS * NUM_BLOCKS * RUN_BLOCK_RANGE, sizeof(AR_TYPE_NAME));
+#else
+    out_sum = calloc(NUM_STREAMS * NUM_BLOCKS * RUN_BLOCK_RANGE, sizeof(AR_TYPE_NAME));
+#endif
+    host_sum = calloc(NUM_STREAMS * NUM_BLOCKS * RUN_BLOCK_RANGE, sizeof(uint32_t));
+#if BCAST != BCAST_NONE
+    for(int i = 0; i < NUM_STREAMS * NUM_BLOCKS; i++){
+        block_first_arrival[i] = UINT64_MAX;
+    }
+#endif
 
     memset(&sim_state, 0, sizeof(sim_state));
 
@@ -513,6 +1091,106 @@ int gdriver_run()
 
 int gdriver_fini()
 {
+#ifdef TRACE_OUT
+    fclose(trace_out);
+#endif
+#if REDUCE_SCATTER
+    for(int i = 0; i < RUN_SWITCH_PORTS; i++){
+        printf("SCATTER port %d: out pkts %u bytes %lu\n", i, port_out_pkts[i], port_out_bytes[i]);
+    }
+#endif
+#if COALESCE_OUTPUT
+    printf("COALESCE: %u of the out pkts carried %u packets\n", coalesced_pkts, coalesced_segments);
+#endif
+#ifdef TRACE_DOWN
+    printf("TREE level %d down: %u pkts from the parent, %u sent to %d children\n", TREE_LEVEL, down_in_pkts, down_out_pkts, RUN_SWITCH_PORTS);
+#endif
+    printf("TREE level %d fan-in %d: in pkts %u bytes %lu, out pkts %u bytes %lu, latency %lu cycles\n", TREE_LEVEL, RUN_SWITCH_PORTS, tree_in_pkts, tree_in_bytes, tree_out_pkts, tree_out_bytes, tree_last_feedback - tree_first_arrival);
+#if AR_STATS
+    for(int i = 0; i < NUM_CLUSTERS; i++){
+        printf("STATS cluster %d: pkts %u l2 pkts %u flushes %u batched %u malformed %u\n", i, cluster_stats[i].pkts, cluster_stats[i].l2_pkts, cluster_stats[i].flushes, cluster_stats[i].batched, cluster_stats[i].malformed);
+    }
+#endif
+#if PHASE_CYCLES
+    uint64_t phase_total[AR_PHASES] = {0};
+    for(int i = 0; i < NUM_CLUSTERS * AR_OUT_BUFFERS; i++){
+        PhaseCycles* c = &hpu_cycles[i];
+        printf("CYCLES cluster %d hpu %d: pkts %u lock %u aggregate %u bookkeeping %u flush %u\n", i / AR_OUT_BUFFERS, i % AR_OUT_BUFFERS, c->pkts, c->cycles[PHASE_LOCK], c->cycles[PHASE_AGGREGATE], c->cycles[PHASE_BOOKKEEPING], c->cycles[PHASE_FLUSH]);
+        for(int p = 0; p < AR_PHASES; p++){
+            phase_total[p] += c->cycles[p];
+        }
+    }
+    printf("CYCLES total: lock %lu aggregate %lu bookkeeping %lu flush %lu\n", phase_total[PHASE_LOCK], phase_total[PHASE_AGGREGATE], phase_total[PHASE_BOOKKEEPING], phase_total[PHASE_FLUSH]);
+#endif
+#if ROOT_MODE
+    // Every block must have been written once, with the sum of what the hosts sent (unknown for a replayed trace)
+    uint32_t mismatches = 0;
+    uint32_t root_blocks_written = 0;
+    for(size_t i = 0; i < (ROOT_WRITES + 31) / 32; i++){
+        root_blocks_written += __builtin_popcount(root_written[i]);
+    }
+#ifndef TRACE_IN
+    for(size_t i = 0; i < NUM_STREAMS * NUM_BLOCKS * RUN_BLOCK_RANGE; i++){
+        if(root_result[i] != (AR_TYPE_NAME) host_sum[i]){
+            ++mismatches;
+        }
+    }
+#endif
+    printf("ROOT blocks written %u of %d, mismatching values %u\n", root_blocks_written, ROOT_WRITES, mismatches);
+    if(root_blocks_written != ROOT_WRITES || mismatches){
+        pspinsim_fini();
+        return 0; // Like a packet count mismatch
+    }
+#else
+    // Every block (shard) must have been closed once, by a packet counting all the packets of it, and the values
+    // sent must add up to what the hosts sent (unknown for a replayed trace). Top-k drops values, only the ones it
+    // kept are compared.
+    uint32_t unclosed = 0, mismatches = 0;
+    for(size_t k = 0; k < NUM_STREAMS * NUM_BLOCKS * OUT_SHARDS; k++){
+        if(out_closes[k] != 1 || out_split[k] != out_pkts[k]){
+            ++unclosed;
+        }
+    }
+#ifndef TRACE_IN
+    for(size_t i = 0; i < NUM_STREAMS * NUM_BLOCKS * RUN_BLOCK_RANGE; i++){
+        if(out_sum[i] != (AR_TYPE_NAME) host_sum[i] && (TOPK_ELEMENTS == 0 || out_sum[i] != 0)){
+            ++mismatches;
+        }
+    }
+#endif
+#if TOPK_ELEMENTS > 0
+    // At most TOPK_ELEMENTS values of a block leave a dense table. Values that collide in the hash table are all
+    // sent, even past TOPK_ELEMENTS.
+    uint32_t over_k = 0;
+    for(size_t b = 0; b < NUM_STREAMS * NUM_BLOCKS; b++){
+        if(out_values[b] > TOPK_ELEMENTS){
+            ++over_k;
+        }
+    }
+    printf("TOPK blocks with more than %d values %u\n", TOPK_ELEMENTS, over_k);
+    if(STORAGE_TYPE == STORAGE_TYPE_DENSE && over_k){
+        mismatches += over_k;
+    }
+#endif
+    printf("CHECK blocks not closed once with their packet count %u, misplaced values %u, mismatching values %u\n", unclosed, out_misplaced, mismatches);
+    if(unclosed || out_misplaced || mismatches){
+        pspinsim_fini();
+        return 0; // Like a packet count mismatch
+    }
+#endif
+#if BCAST != BCAST_NONE
+    // Allreduce completion of each block: from its first packet entering the NIC to the end of the broadcast
+    uint64_t completion_sum = 0, completion_max = 0;
+    for(int i = 0; i < NUM_STREAMS * NUM_BLOCKS; i++){
+        uint64_t completion = block_last_feedback[i] - block_first_arrival[i];
+        printf("BCAST stream %d block %d completion %lu cycles\n", i / NUM_BLOCKS, i % NUM_BLOCKS, completion);
+        completion_sum += completion;
+        if(completion > completion_max){
+            completion_max = completion;
+        }
+    }
+    printf("BCAST completion mean %lu max %lu cycles\n", completion_sum / (NUM_STREAMS * NUM_BLOCKS), completion_max);
+#endif
     if (pspinsim_fini() == SPIN_SUCCESS)
         return sim_state.packets_sent == sim_state.packets_processed;
     return GDRIVER_ERR;
@@ -19,10 +19,15 @@ for hosts in 8 16 32; do
 done
 
 #hash
-for hosts in 8 16 32; do
-    for blocks in 8 16 32; do
+# Hash slots do not depend on the sparsity, the handler is built once with runtime_config=1 for the largest fan-in and
+# sparsity of the sweep and only the driver is rebuilt per point. Dense slots are sized by the block, so the array
+# sweeps keep one handler build per point.
+for blocks in 8 16 32; do
+    HASH_VARS="runtime_config=1 DATA_TYPE=0 STORE_TYPE=1 blocks=${blocks} streams=1 max_hosts=32 max_ratio=128"
+    make deploy -j $HASH_VARS
+    for hosts in 8 16 32; do
         for sparse in 1 2 8 32 128; do
-            make deploy driver -j ALLREDUCE_FLAGS="-DAR_TYPE=0 -DSTORAGE_TYPE=1 -DBLOCK_TO_NONZERO_RATIO=${sparse} -DNUM_SWITCH_PORTS=${hosts} -DNUM_BLOCKS=${blocks} -DNUM_STREAMS=1"
+            make driver -j $HASH_VARS hosts=${hosts} SPARSE_RATIO=${sparse}
             echo $hosts $blocks "int32 ar_multi_sparse hash" $sparse
             ./sim_ar_multi_sparse > transcript
             target=$(cat transcript | tail -20 | head -12 | grep -Eo '[0-9\.]+' | tr "\n" " ")
@@ -30,4 +35,16 @@ for hosts in 8 16 32; do
             
         done
     done
-done
\ No newline at end of file
+done
+# Hash table size of the run: collisions go out through the stash, so smaller tables send more packets. Same
+# handler build as above, the size reaches it in the AllreduceConfig.
+echo "Hosts Blocks HashSize Sparsity InPkts InBytes InAvgPktLen FeedbackThroughput FeedbackArrival PktAvgLat PktMinLat PktMaxLat HERstalls Commands OutPkts OutBytes OutAvgPktLen PktThroughput PktDepTime" > result_hash_size.csv
+HASH_VARS="runtime_config=1 DATA_TYPE=0 STORE_TYPE=1 blocks=32 streams=1 max_hosts=32 max_ratio=8"
+make deploy -j $HASH_VARS
+for hash_size in 64 128 256; do
+    make driver -j $HASH_VARS hosts=32 SPARSE_RATIO=8 hash_size=${hash_size}
+    echo 32 32 $hash_size 8
+    ./sim_ar_multi_sparse > transcript
+    target=$(cat transcript | tail -20 | head -12 | grep -Eo '[0-9\.]+' | tr "\n" " ")
+    echo 32 32 $hash_size 8 $target >> result_hash_size.csv
+done
@@ -20,11 +20,16 @@ for hosts in 16; do
 done
 
 #hash
+# Hash slots do not depend on the sparsity, the handler is built once with runtime_config=1 for the largest fan-in and
+# sparsity of the sweep and only the driver is rebuilt per point. Dense slots are sized by the block, so the array
+# sweeps keep one handler build per point.
 for hosts in 16; do
     for blocks in 8 16 32; do
-        for sparse in 2 8; do
-            for streams in 2 3 4; do
-                make deploy driver -j ALLREDUCE_FLAGS="-DAR_TYPE=0 -DSTORAGE_TYPE=1 -DBLOCK_TO_NONZERO_RATIO=${sparse} -DNUM_SWITCH_PORTS=${hosts} -DNUM_BLOCKS=${blocks} -DNUM_STREAMS=${streams}"
+        for streams in 2 3 4; do
+            HASH_VARS="runtime_config=1 DATA_TYPE=0 STORE_TYPE=1 blocks=${blocks} streams=${streams} max_hosts=${hosts} max_ratio=8"
+            make deploy -j $HASH_VARS
+            for sparse in 2 8; do
+                make driver -j $HASH_VARS hosts=${hosts} SPARSE_RATIO=${sparse}
                 echo $hosts $blocks "int32 ar_multi_sparse hash" $sparse $streams
                 ./sim_ar_multi_sparse > transcript
                 target=$(cat transcript | tail -20 | head -12 | grep -Eo '[0-9\.]+' | tr "\n" " ")
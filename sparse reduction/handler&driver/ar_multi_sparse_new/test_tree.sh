@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Reduction tree: each level replays the output trace of the level below, with the fan-in of the level as ports.
+# Compares how array and hash storage cope with the fill-in of the sparse blocks at the upper levels.
+echo "Storage Level FanIn InPkts InBytes OutPkts OutBytes Latency" > result_tree.csv
+
+fanins="16 8 4"
+for storage in 0 1; do
+    level=0
+    trace_in=
+    for fanin in $fanins; do
+        trace_out=level${level}.trace
+        make deploy driver -j STORE_TYPE=${storage} SPARSE_RATIO=8 hosts=${fanin} tree_level=${level} trace_in=${trace_in} trace_out=${trace_out}
+        ./sim_ar_multi_sparse > transcript
+        target=$(grep "^TREE" transcript | grep -Eo '[0-9]+' | tail -5 | tr "\n" " ")
+        echo $storage $level $fanin $target >> result_tree.csv
+        trace_in=${trace_out}
+        level=$((level+1))
+    done
+done
+
+# Broadcast through an intermediate level: the top level is the root of a BCAST_ROOT tree and writes the blocks it
+# sends down, the middle level then runs again with BCAST_FORWARD and passes them on to its children.
+echo "Storage DownIn DownOut CompletionMean CompletionMax" > result_bcast.csv
+for storage in 0 1; do
+    make deploy driver -j STORE_TYPE=${storage} SPARSE_RATIO=8 hosts=16 tree_level=0 trace_out=bcast0.trace
+    ./sim_ar_multi_sparse > transcript
+    make deploy driver -j STORE_TYPE=${storage} SPARSE_RATIO=8 hosts=8 tree_level=1 trace_in=bcast0.trace trace_out=bcast1.trace
+    ./sim_ar_multi_sparse > transcript
+    make deploy driver -j STORE_TYPE=${storage} SPARSE_RATIO=8 hosts=4 tree_level=2 bcast=2 trace_in=bcast1.trace trace_out=bcast_down.trace
+    ./sim_ar_multi_sparse > transcript
+    make deploy driver -j STORE_TYPE=${storage} SPARSE_RATIO=8 hosts=8 tree_level=1 bcast=1 trace_in=bcast0.trace trace_down=bcast_down.trace
+    ./sim_ar_multi_sparse > transcript
+    down=$(grep "^TREE level 1 down" transcript | grep -Eo '[0-9]+' | sed -n '2,3p' | tr "\n" " ")
+    completion=$(grep "^BCAST completion" transcript | grep -Eo '[0-9]+' | tr "\n" " ")
+    echo $storage $down $completion >> result_bcast.csv
+done
@@ -9,178 +9,1299 @@
 #include <string.h>
 #include "ar_single_sparse.h"
 
-#define NUM_CLUSTERS 4
 #define NUM_CORES_PER_CLUSTER 8
 #define STRIDE 1
 #define OFFSET 0
 #define NUM_INT_OP 0
 
+// Parameters that RUNTIME_CONFIG takes from the slot copy of the configuration
+#if RUNTIME_CONFIG
+#define AR_CHILDREN(info) ((info)->cfg.num_children)
+#define AR_BLOCK_RANGE(info) ((info)->cfg.block_range)
+#define AR_HASH_SIZE(info) ((info)->cfg.hash_size)
+#define AR_HASH_MOD(info, x) ((x) & ((info)->cfg.hash_size - 1))
+#define AR_DENSE_THRESHOLD(info) (((info)->cfg.flags & AR_CFG_DENSE_OUTPUT) ? (info)->cfg.dense_output_threshold : UINT32_MAX)
+#define AR_DROP_DUPLICATES(info) ((info)->cfg.flags & AR_CFG_DROP_DUPLICATES)
+#else
+#define AR_CHILDREN(info) NUM_CHILDREN
+#define AR_BLOCK_RANGE(info) BLOCK_RANGE
+#define AR_HASH_SIZE(info) HASH_SIZE
+#define AR_HASH_MOD(info, x) ((x) % HASH_SIZE)
+#define AR_DENSE_THRESHOLD(info) DENSE_OUTPUT_THRESHOLD
+#define AR_DROP_DUPLICATES(info) 1
+#endif
+
+// With REDUCE_SCATTER the block is flushed as AR_CHILDREN shards, shard p only to port p
+#if REDUCE_SCATTER
+#define AR_SHARDS(info) AR_CHILDREN(info)
+#else
+#define AR_SHARDS(info) 1
+#endif
+#define AR_SHARD_SIZE(info) ((AR_BLOCK_RANGE(info) + AR_SHARDS(info) - 1) / AR_SHARDS(info))
+
+// With CLUSTER_SPLIT the only shard a slot flushes is the slice of its cluster. The slot array starts at the first
+// index of the slice.
+#if CLUSTER_SPLIT
+#define AR_SLICE_SIZE(info) ((AR_BLOCK_RANGE(info) + AR_SLICES - 1) / AR_SLICES)
+#define AR_SHARD_START(info, p) AR_RANGE_CLAMP(info, (info)->slice * AR_SLICE_SIZE(info))
+#define AR_SHARD_END(info, p) AR_RANGE_CLAMP(info, ((info)->slice + 1) * AR_SLICE_SIZE(info))
+#define AR_SLOT_INDEX(info, i) ((i) - (info)->slice * AR_SLICE_SIZE(info))
+#else
+#define AR_SHARD_START(info, p) AR_RANGE_CLAMP(info, (p) * AR_SHARD_SIZE(info))
+#define AR_SHARD_END(info, p) AR_RANGE_CLAMP(info, ((p) + 1) * AR_SHARD_SIZE(info))
+#define AR_SLOT_INDEX(info, i) (i)
+#endif
+#define AR_RANGE_CLAMP(info, i) ((i) < AR_BLOCK_RANGE(info) ? (i) : AR_BLOCK_RANGE(info))
+
 #ifndef HASH_LINEAR_PROBE
     #define HASH_LINEAR_PROBE 0
 #endif
 
 
+#if TOPK_ELEMENTS > 0
+#define TOPK_NUM_BUCKETS 33
+#define TOPK_SUB_BITS 5
+#define TOPK_NUM_SUBS (1 << TOPK_SUB_BITS)
+#define TOPK_BUCKET(key) ((key) >> TOPK_SUB_BITS)
+#define TOPK_SUB(key) ((key) & (TOPK_NUM_SUBS - 1))
+
+typedef struct{
+    uint32_t bucket; // Values in a higher bucket are always kept, values in a lower one are dropped
+    uint32_t sub; // Within the threshold bucket, the same for the sub-buckets
+    uint32_t budget; // How many values of the threshold sub-bucket can still be kept
+}TopkThreshold;
+
+// Key that orders values by magnitude: the bucket is the log2 of the magnitude (the binary exponent for floats,
+// in groups of 8), the sub-bucket the TOPK_SUB_BITS bits below it. Only zero (and float denormals) map to key 0.
+static  __attribute__((always_inline)) inline uint32_t topk_key(AR_TYPE_NAME value){
+#if AR_TYPE == AR_TYPE_FLOAT
+    union { float f; uint32_t u; } bits = { .f = value };
+    return (bits.u & 0x7fffffff) >> (31 - 5 - TOPK_SUB_BITS);
+#else
+    uint32_t magnitude = (value < 0) ? 0u - (uint32_t) value : (uint32_t) value;
+    if(!magnitude){
+        return 0;
+    }
+    uint32_t top = 31 - __builtin_clz(magnitude);
+    uint32_t sub = (top >= TOPK_SUB_BITS) ? magnitude >> (top - TOPK_SUB_BITS) : magnitude << (TOPK_SUB_BITS - top);
+    return ((top + 1) << TOPK_SUB_BITS) | TOPK_SUB(sub);
+#endif
+}
+
+// Walks a histogram from the largest magnitudes down until want values are covered, returns the bucket where
+// that happens and how many of its values can be kept
+static  __attribute__((always_inline)) inline uint32_t topk_walk(uint32_t* hist, uint32_t buckets, uint32_t want, uint32_t* budget){
+    uint32_t kept = 0;
+    for(int32_t b = buckets - 1; b >= 0; b--){
+        if(kept + hist[b] >= want){
+            *budget = want - kept;
+            return b;
+        }
+        kept += hist[b];
+    }
+    // Less than want values, keep everything
+    *budget = kept;
+    return 0;
+}
+
+// First pass, on the histogram of the buckets, keeping want values
+static  __attribute__((always_inline)) inline void topk_threshold(uint32_t* hist, uint32_t want, TopkThreshold* thr){
+    thr->bucket = topk_walk(hist, TOPK_NUM_BUCKETS, want, &(thr->budget));
+}
+
+// How many values of the table can be kept once the collisions that already left are counted against k
+static  __attribute__((always_inline)) inline uint32_t topk_want(uint32_t stashed){
+    return stashed < TOPK_ELEMENTS ? TOPK_ELEMENTS - stashed : 0;
+}
+
+// Second pass, counts the values of the threshold bucket per sub-bucket
+static  __attribute__((always_inline)) inline void topk_count_sub(uint32_t* sub_hist, uint32_t key, TopkThreshold* thr){
+    if(TOPK_BUCKET(key) == thr->bucket){
+        ++sub_hist[TOPK_SUB(key)];
+    }
+}
+
+static  __attribute__((always_inline)) inline void topk_refine(uint32_t* sub_hist, TopkThreshold* thr){
+    thr->sub = topk_walk(sub_hist, TOPK_NUM_SUBS, thr->budget, &(thr->budget));
+}
+
+// Only the values of the threshold sub-bucket are kept in index order, up to the budget
+static  __attribute__((always_inline)) inline int topk_keep(uint32_t key, TopkThreshold* thr){
+    uint32_t bucket = TOPK_BUCKET(key);
+    if(bucket != thr->bucket){
+        return bucket > thr->bucket;
+    }
+    if(TOPK_SUB(key) != thr->sub){
+        return TOPK_SUB(key) > thr->sub;
+    }
+    if(thr->budget){
+        --thr->budget;
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+
+#if STRAGGLER_TIMEOUT > 0
+// Blocks flushed by flush_partial are marked, along with the children whose last packet they hold
+#define AR_OUT_FLAGS(info) (((info)->partial_id == (info)->id + 1) ? AR_FLAG_PARTIAL : 0)
+#define AR_OUT_CHILDREN(hdr, info) ((hdr)->children = (info)->children_done)
+#else
+#define AR_OUT_FLAGS(info) 0
+#define AR_OUT_CHILDREN(hdr, info)
+#endif
+// Seq of the n-th packet (from 0) the slot sends of a block, the parent drops duplicates by it. The slices of a
+// split block number theirs apart.
+#if CLUSTER_SPLIT
+#define AR_OUT_SEQ(info, n) ((n) * AR_SLICES + (info)->slice)
+#else
+#define AR_OUT_SEQ(info, n) (n)
+#endif
+
+#if STRAGGLER_TIMEOUT > 0 || COALESCE_OUTPUT || PHASE_CYCLES
+static  __attribute__((always_inline)) inline uint32_t cycles_now(){
+    uint32_t cycles;
+    asm volatile ("csrr %0, mcycle" : "=r" (cycles));
+    return cycles;
+}
+#endif
+
+#if BCAST != BCAST_NONE
+// Replicates frame to the ports of all the children. The copies share the frame and differ only in the port of
+// the header, so each send completes before the port is rewritten for the next one. handle is left complete.
+static  __attribute__((always_inline)) inline void send_down(void* frame, uint32_t len, spin_cmd_t* handle, uint32_t children){
+    AllreducePacket* ar = (AllreducePacket*) ((u_char*) frame + SIZE_IP_UDP_HDRS);
+    ar->hdr.flags |= AR_FLAG_BCAST;
+    for(uint32_t c = 0; c < children; c++){
+        ar->hdr.port = c;
+        spin_send_packet(frame, len, handle);
+        spin_cmd_wait(*handle);
+    }
+}
+#endif
+
+#if COALESCE_OUTPUT
+// Sends the coalesced packet, with the lock of co held. The frame is refilled right after, so the send is waited for.
+static  __attribute__((always_inline)) inline void coalesce_send(volatile Coalescer* co){
+#if DEBUG
+    printf("Sending %d coalesced packets\n", ((AllreducePacket*) (co->frame + SIZE_IP_UDP_HDRS))->hdr.num_values);
+#endif
+    spin_cmd_t handle;
+    spin_send_packet((void*) co->frame, AR_WIRE_LEN(co->len), &handle);
+    spin_cmd_wait(handle);
+    co->len = 0;
+}
+
+// Appends the packet in frame to the coalesced packet of the cluster, unless it is too long to be worth it
+static  __attribute__((always_inline)) inline void coalesce_out(u_char* frame, uint32_t len, spin_cmd_t* handle, volatile Coalescer* co){
+    if(len > COALESCE_MAX_LEN){
+        spin_send_packet(frame, len, handle);
+        return;
+    }
+    AllreducePacket* ar = (AllreducePacket*) (frame + SIZE_IP_UDP_HDRS);
+    AllreducePacket* ar_out = (AllreducePacket*) (co->frame + SIZE_IP_UDP_HDRS);
+    uint32_t segment = AR_SEGMENT_LEN(&(ar->hdr));
+    spin_lock_lock(&(co->lock));
+    if(co->len && co->len + segment > PKT_SIZE){
+        coalesce_send(co);
+    }
+    if(!co->len){ // The first packet lends its headers
+        memcpy((void*) co->frame, frame, SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader));
+        ar_out->hdr.num_values = 0;
+        ar_out->hdr.block_split_num = 0;
+        ar_out->hdr.flags = AR_FLAG_COALESCED;
+        co->len = SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader);
+        co->first = cycles_now();
+    }
+    memcpy((void*) (co->frame + co->len), &(ar->hdr), segment);
+    co->len += segment;
+    ar_out->hdr.num_values++;
+    if(!co->open){ // Nothing else is on its way (e.g. the chunks of a deferred flush)
+        coalesce_send(co);
+    }
+    spin_lock_unlock(&(co->lock));
+}
+
+// A block of the cluster flushed, if it was the last open one nothing would join the coalesced packet
+static  __attribute__((always_inline)) inline void coalesce_close(volatile Coalescer* co){
+    if(amo_add(&(co->open), -1) == 1){
+        spin_lock_lock(&(co->lock));
+        if(co->len && !co->open){
+            coalesce_send(co);
+        }
+        spin_lock_unlock(&(co->lock));
+    }
+}
+
+// Sends the coalesced packet once its first packet waited COALESCE_TIMEOUT cycles, if nobody else is at it
+static  __attribute__((always_inline)) inline void coalesce_poll(volatile Coalescer* co){
+    if(co->len && (int32_t) (cycles_now() - co->first) > COALESCE_TIMEOUT && spin_lock_try_lock(&(co->lock))){
+        if(co->len && (int32_t) (cycles_now() - co->first) > COALESCE_TIMEOUT){
+            coalesce_send(co);
+        }
+        spin_lock_unlock(&(co->lock));
+    }
+}
+#endif
+
+// At the root of a BCAST_ROOT tree the reduced blocks go down to the children rather than up
+#if BCAST == BCAST_ROOT
+#define AR_SEND_OUT(frame, len, handle, info) send_down((frame), (len), (handle), AR_CHILDREN(info))
+#elif COALESCE_OUTPUT
+#define AR_SEND_OUT(frame, len, handle, info) coalesce_out((u_char*) (frame), (len), (handle), (info)->coalescer)
+#else
+#define AR_SEND_OUT(frame, len, handle, info) spin_send_packet((frame), (len), (handle))
+#endif
+
+// Incoming packets are read one 32-bit word at a time, AllreducePacket keeps both of its arrays word aligned.
+// A step covers a whole number of index words and of value words.
+#define AR_WORD_LANES (AR_WORD_SIZE / sizeof(AR_TYPE_NAME))
+#define AR_INDEX_LANES (AR_WORD_SIZE / sizeof(AR_INDEX_NAME))
+#define AR_STEP_ELEMENTS (AR_WORD_LANES > AR_INDEX_LANES ? AR_WORD_LANES : AR_INDEX_LANES)
+#define AR_STEP_VALUES (AR_STEP_ELEMENTS * VALUES_PER_ELEMENT)
+
+typedef uint32_t __attribute__((may_alias)) ar_word_t;
+
+typedef union{
+    uint32_t words[AR_STEP_ELEMENTS / AR_INDEX_LANES];
+    AR_INDEX_NAME lanes[AR_STEP_ELEMENTS];
+}IndexStep;
+
+typedef union{
+    uint32_t words[AR_STEP_VALUES / AR_WORD_LANES];
+    AR_TYPE_NAME lanes[AR_STEP_VALUES];
+}ValueStep;
+
+static  __attribute__((always_inline)) inline void load_step(const ar_word_t* index_words, const ar_word_t* value_words, uint32_t step, IndexStep* index, ValueStep* values){
+    index_words += step * (AR_STEP_ELEMENTS / AR_INDEX_LANES);
+    value_words += step * (AR_STEP_VALUES / AR_WORD_LANES);
+    for(uint32_t w = 0; w < AR_STEP_ELEMENTS / AR_INDEX_LANES; w++){
+        index->words[w] = index_words[w];
+    }
+    for(uint32_t w = 0; w < AR_STEP_VALUES / AR_WORD_LANES; w++){
+        values->words[w] = value_words[w];
+    }
+}
+
+
+#if CLUSTER_SPLIT
+// Adds the packets the slice of the slot sent to the count of its block. Returns 0, or for the last slice to
+// flush the number of packets of the whole block including the closing one it sends.
+static  __attribute__((always_inline)) inline uint32_t slice_close(AllreduceInfo* ar_info_local, uint32_t sent){
+    volatile SliceCount* count = ar_info_local->slice_count;
+    amo_add(&(count->sent), sent);
+    if(amo_add(&(count->slices), 1) + 1 < AR_SLICES){
+        return 0;
+    }
+    sent = count->sent + 1;
+    count->sent = 0; // For the next block of the slot
+    count->slices = 0;
+    return sent;
+}
+#endif
+
 #if STORAGE_TYPE == STORAGE_TYPE_DENSE
 static  __attribute__((always_inline)) inline void aggregate_block(AllreducePacket* ar, AllreduceInfo* ar_info_local){
-    for (uint32_t i = 0; i < ar->hdr.num_values; i++){
-        ar_info_local->data[ar->index[i]] += (ar->data)[i];
+#if DENSE_OUTPUT == 1
+    if(ar->hdr.flags & AR_FLAG_DENSE){
+        AllreduceDensePacket* ar_dense = (AllreduceDensePacket*) ar;
+        for (uint32_t i = 0; i < ar_dense->hdr.num_values; i++){
+            ar_info_local->data[ar_dense->start + i] += (ar_dense->data)[i];
+        }
+        return;
+    }
+#endif
+    const ar_word_t* index_words = (const ar_word_t*) AR_PKT_INDEX(ar);
+    const ar_word_t* value_words = (const ar_word_t*) ar->data;
+    uint32_t steps = ar->hdr.num_values / AR_STEP_ELEMENTS;
+    for(uint32_t s = 0; s < steps; s++){
+        IndexStep index;
+        ValueStep values;
+        load_step(index_words, value_words, s, &index, &values);
+        for(uint32_t k = 0; k < AR_STEP_ELEMENTS; k++){
+            ar_info_local->data[AR_SLOT_INDEX(ar_info_local, AR_BLOCK_INDEX(ar, index.lanes[k]))] += values.lanes[k];
+        }
+    }
+    // Elements left over after the last full step
+    AR_INDEX_NAME* indexes = AR_PKT_INDEX(ar);
+    for(uint32_t i = steps * AR_STEP_ELEMENTS; i < ar->hdr.num_values; i++){
+        ar_info_local->data[AR_SLOT_INDEX(ar_info_local, AR_BLOCK_INDEX(ar, indexes[i]))] += ar->data[i];
     }
 }
 
-static  __attribute__((always_inline)) inline void flush_block(AllreducePacket* ar, AllreduceInfo* ar_info_local, u_char* out_buffer){
+#if DENSE_OUTPUT == 1
+// Sends the whole block as contiguous runs of values, used when almost every index is set
+static  __attribute__((always_inline)) inline void flush_block_dense(uint32_t id, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    AllreduceDensePacket* ar_out = (AllreduceDensePacket*) (out_buffer + SIZE_IP_UDP_HDRS);
+    ar_out->hdr.id = id;
+    ar_out->hdr.flags = AR_FLAG_DENSE | AR_OUT_FLAGS(ar_info_local);
+    AR_OUT_CHILDREN(&(ar_out->hdr), ar_info_local);
+    ar_out->hdr.version = AR_PKT_VERSION;
+    ar_out->hdr.coll_id = ar_info_local->coll_id;
+    uint32_t shard_size = AR_SHARD_SIZE(ar_info_local);
+    for(uint32_t p = 0; p < AR_SHARDS(ar_info_local); p++){
+        uint32_t shard_end = (p + 1) * shard_size < AR_BLOCK_RANGE(ar_info_local) ? (p + 1) * shard_size : AR_BLOCK_RANGE(ar_info_local);
+        uint32_t blocks_sent = 0;
+        ar_out->hdr.port = p;
+        // Runs until the end of the shard, every shard gets at least one packet to close it
+        uint32_t start = p * shard_size < shard_end ? p * shard_size : shard_end;
+        do{
+            uint32_t n = (shard_end - start < MAX_DENSE_DATA_ELEMENTS) ? (shard_end - start) : MAX_DENSE_DATA_ELEMENTS;
+            for(uint32_t i = 0; i < n; i++){
+                ar_out->data[i] = ar_info_local->data[start + i];
+                ar_info_local->data[start + i] = 0;
+            }
+            ar_out->start = start;
+            ar_out->hdr.num_values = n;
+            ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent++);
+            ar_out->hdr.block_split_num = (start + n == shard_end) ? blocks_sent : 0;
+            spin_cmd_t handle;
 #if DEBUG
-    printf("Flushing block id %d\n", ar->hdr.id);
+            printf("Sending dense pkt with %d values from %d id %d\n", n, start, id);
+#endif
+            AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_DENSE_PKT_LEN(n)), &handle, ar_info_local); // Send to the next level of the tree
+            start += n;
+        }while(start < shard_end);
+    }
+    ar_info_local->num_children = 0;
+}
+#endif
+
+#if ROOT_MODE
+// At the root the block (with CLUSTER_SPLIT, the slice) goes straight to its place in the host buffer. The DMA
+// reads the slot, so it is waited for before the slot is cleared for the next block.
+static  __attribute__((always_inline)) inline void flush_block_root(task_t* task, uint32_t id, uint32_t root_address, AllreduceInfo* ar_info_local){
+#if DEBUG
+    printf("Writing block id %d to the host\n", id);
+#endif
+    uint32_t block_bytes = AR_BLOCK_RANGE(ar_info_local) * sizeof(AR_TYPE_NAME);
+    uint32_t start = AR_SHARD_START(ar_info_local, 0);
+    uint32_t bytes = (AR_SHARD_END(ar_info_local, 0) - start) * sizeof(AR_TYPE_NAME);
+    uint64_t host_address = (((uint64_t) task->host_mem_high << 32) | task->host_mem_low) + root_address + (uint64_t) id * block_bytes + start * sizeof(AR_TYPE_NAME);
+    spin_cmd_t handle;
+    spin_dma_to_host(host_address, (uint32_t) ar_info_local->data, bytes, 0, &handle);
+    spin_cmd_wait(handle);
+    memset(ar_info_local->data, 0, bytes);
+    ar_info_local->num_children = 0;
+}
+#endif
+
+#if DEFERRED_FLUSH || STREAM_FLUSH
+#if DEFERRED_FLUSH
+// The chunks of a block are sent in parallel, they number their packets from the count of the block
+#define AR_RANGE_SEQ(info, sent) ((void) (sent), amo_add(&((info)->flush_sent), 1))
+#else
+#define AR_RANGE_SEQ(info, sent) AR_OUT_SEQ(info, sent)
 #endif
-    int i = 0, j = 0;
+
+// Sends the nonzeros of [start, end) of block id, after the sent packets of it that already left.
+// With close the last packet (header-only if nothing is left for it) carries the number of packets of the
+// whole block. Returns the packets of the block sent so far.
+static  __attribute__((always_inline)) inline uint32_t send_range(uint32_t id, uint32_t start, uint32_t end, uint32_t sent, int close, AllreduceInfo* ar_info_local, u_char* out_buffer){
     AllreducePacket* ar_out = (AllreducePacket*) (out_buffer + SIZE_IP_UDP_HDRS);
-    ar_out->hdr.id = ar->hdr.id;
+    ar_out->hdr.id = id;
+    ar_out->hdr.flags = AR_OUT_FLAGS(ar_info_local);
+    AR_OUT_CHILDREN(&(ar_out->hdr), ar_info_local);
+    ar_out->hdr.version = AR_PKT_VERSION;
+    ar_out->hdr.coll_id = ar_info_local->coll_id;
+    ar_out->hdr.port = 0;
     ar_out->hdr.num_values = MAX_DATA_ELEMENTS;
     ar_out->hdr.block_split_num = 0;
-    uint32_t blocks_sent = 0;
-    for(int i = 0; i < BLOCK_RANGE; i++){
+    spin_cmd_t handle;
+    uint32_t j = 0;
+    for(uint32_t i = start; i < end; i++){
         if(ar_info_local->data[i]){
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+            if(j && i - ar_out->base >= AR_BASE_WINDOW){
+                // Out of the window of this packet, send what it holds
+                ar_out->hdr.num_values = j;
+                AR_PKT_COMPACT(ar_out);
+                ar_out->hdr.seq = AR_RANGE_SEQ(ar_info_local, sent++);
+                AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_PKT_LEN(j)), &handle, ar_info_local); // Send to the next level of the tree
+                ar_out->hdr.num_values = MAX_DATA_ELEMENTS;
+                j = 0;
+            }
+            if(j == 0){
+                ar_out->base = i;
+            }
+            ar_out->index[j] = i - ar_out->base;
+#else
             ar_out->index[j] = i;
+#endif
             ar_out->data[j] = ar_info_local->data[i];
-            ar_info_local->data[i] = 0; // If it was zero no need to set it to zero
+            ar_info_local->data[i] = 0;
             if(++j == MAX_DATA_ELEMENTS){
-                spin_cmd_t handle;
-#if DEBUG
-                printf("Sending full pkt id %d\n", ar->hdr.id);
-#endif            
-                ++blocks_sent;
-                spin_send_packet(out_buffer, PKT_SIZE, &handle); // Send to the next level of the tree            
+                ar_out->hdr.seq = AR_RANGE_SEQ(ar_info_local, sent++);
+                AR_SEND_OUT(out_buffer, PKT_SIZE, &handle, ar_info_local); // Send to the next level of the tree
                 j = 0;
             }
         }
     }
-    if(j){
+    if(j || close){
+        ar_out->hdr.num_values = j;
+        ar_out->hdr.block_split_num = close ? sent + 1 : 0;
+        AR_PKT_COMPACT(ar_out);
+        ar_out->hdr.seq = AR_RANGE_SEQ(ar_info_local, sent++);
+        AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_PKT_LEN(j)), &handle, ar_info_local); // Send to the next level of the tree
+    }
+    return sent;
+}
+#endif
+
+static  __attribute__((always_inline)) inline void flush_block(uint32_t id, AllreduceInfo* ar_info_local, u_char* out_buffer){
+#if DEBUG
+    printf("Flushing block id %d\n", id);
+#endif
+#if STREAM_FLUSH
+    // Only what was not streamed yet is left, its last packet closes the whole block
+    send_range(id, ar_info_local->stream_flushed, AR_BLOCK_RANGE(ar_info_local), ar_info_local->stream_sent, 1, ar_info_local, out_buffer);
+    ar_info_local->num_children = 0;
+    return;
+#endif
+#if DENSE_OUTPUT == 1 || TOPK_ELEMENTS > 0
+    uint32_t nonzeros = 0;
+#if TOPK_ELEMENTS > 0
+    uint32_t hist[TOPK_NUM_BUCKETS] = {0};
+    uint32_t dropped = 0;
+#endif
+    for(uint32_t i = 0; i < AR_BLOCK_RANGE(ar_info_local); i++){
+        if(ar_info_local->data[i]){
+            ++nonzeros;
+#if TOPK_ELEMENTS > 0
+            ++hist[TOPK_BUCKET(topk_key(ar_info_local->data[i]))];
+#endif
+        }
+    }
+#if TOPK_ELEMENTS > 0
+    TopkThreshold thr;
+    topk_threshold(hist, TOPK_ELEMENTS, &thr);
+    uint32_t sub_hist[TOPK_NUM_SUBS] = {0};
+    for(uint32_t i = 0; i < AR_BLOCK_RANGE(ar_info_local); i++){
+        if(ar_info_local->data[i]){
+            topk_count_sub(sub_hist, topk_key(ar_info_local->data[i]), &thr);
+        }
+    }
+    topk_refine(sub_hist, &thr);
+#endif
+#if DENSE_OUTPUT == 1
+    if(nonzeros > AR_DENSE_THRESHOLD(ar_info_local) && (TOPK_ELEMENTS == 0 || nonzeros <= TOPK_ELEMENTS)){
+        flush_block_dense(id, ar_info_local, out_buffer);
+        return;
+    }
+#endif
+#endif
+    AllreducePacket* ar_out = (AllreducePacket*) (out_buffer + SIZE_IP_UDP_HDRS);
+    ar_out->hdr.id = id;
+    ar_out->hdr.flags = AR_OUT_FLAGS(ar_info_local);
+    AR_OUT_CHILDREN(&(ar_out->hdr), ar_info_local);
+    ar_out->hdr.version = AR_PKT_VERSION;
+    ar_out->hdr.coll_id = ar_info_local->coll_id;
+    for(uint32_t p = 0; p < AR_SHARDS(ar_info_local); p++){
+        uint32_t shard_start = AR_SHARD_START(ar_info_local, p);
+        uint32_t shard_end = AR_SHARD_END(ar_info_local, p);
+        uint32_t j = 0;
+        uint32_t blocks_sent = 0;
+        ar_out->hdr.port = p;
+        ar_out->hdr.num_values = MAX_DATA_ELEMENTS;
+        ar_out->hdr.block_split_num = 0;
+        for(uint32_t i = shard_start; i < shard_end; i++){
+            uint32_t k = AR_SLOT_INDEX(ar_info_local, i);
+            if(ar_info_local->data[k]){
+#if TOPK_ELEMENTS > 0
+                if(!topk_keep(topk_key(ar_info_local->data[k]), &thr)){
+                    ar_info_local->data[k] = 0;
+                    ++dropped;
+                    continue;
+                }
+#endif
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+                if(j && i - ar_out->base >= AR_BASE_WINDOW){
+                    // Out of the window of this packet, send what it holds
+                    ar_out->hdr.num_values = j;
+                    AR_PKT_COMPACT(ar_out);
+                    spin_cmd_t handle;
+                    ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent++);
+                    AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_PKT_LEN(j)), &handle, ar_info_local); // Send to the next level of the tree
+                    ar_out->hdr.num_values = MAX_DATA_ELEMENTS;
+                    j = 0;
+                }
+                if(j == 0){
+                    ar_out->base = i;
+                }
+                ar_out->index[j] = i - ar_out->base;
+#else
+                ar_out->index[j] = i;
+#endif
+                ar_out->data[j] = ar_info_local->data[k];
+                ar_info_local->data[k] = 0; // If it was zero no need to set it to zero
+                if(++j == MAX_DATA_ELEMENTS){
+                    spin_cmd_t handle;
+#if DEBUG
+                    printf("Sending full pkt id %d\n", id);
+#endif            
+                    ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent++);
+                    AR_SEND_OUT(out_buffer, PKT_SIZE, &handle, ar_info_local); // Send to the next level of the tree            
+                    j = 0;
+                }
+            }
+        }
+        // The last packet carries the number of packets the block (or shard) was split in. It is header-only
+        // if it reduced to all zeros or its nonzeros exactly filled the previous packets.
         ar_out->hdr.num_values = j;
         spin_cmd_t handle;
 #if DEBUG
-        printf("Sending pkt with %d elements id %d\n", j, ar->hdr.id);
+        printf("Sending pkt with %d elements id %d\n", j, id);
 #endif            
+#if CLUSTER_SPLIT
+        if(j){
+            AR_PKT_COMPACT(ar_out);
+            ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent++);
+            AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_PKT_LEN(j)), &handle, ar_info_local); // Send to the next level of the tree
+            ar_out->hdr.num_values = j = 0;
+        }
+        ar_out->hdr.block_split_num = slice_close(ar_info_local, blocks_sent);
+        if(!ar_out->hdr.block_split_num){
+            continue; // The cluster of the last slice closes the block
+        }
+        ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent);
+#else
+        ar_out->hdr.seq = AR_OUT_SEQ(ar_info_local, blocks_sent);
         ar_out->hdr.block_split_num = ++blocks_sent;
-        spin_send_packet(out_buffer, PKT_SIZE - (AR_TYPE_SIZE*(MAX_DATA_ELEMENTS - j)), &handle); // Send to the next level of the tree            
+#endif
+        AR_PKT_COMPACT(ar_out);
+        AR_SEND_OUT(out_buffer, AR_WIRE_LEN(AR_PKT_LEN(j)), &handle, ar_info_local); // Send to the next level of the tree            
     }
 
+#if TOPK_ELEMENTS > 0 && TOPK_REPORT == 1
+    printf("TOPK block %d dropped %d values\n", id, dropped);
+#endif
     ar_info_local->num_children = 0;
 }
-#elif STORAGE_TYPE == STORAGE_TYPE_HASH
-static  __attribute__((always_inline)) inline void aggregate_block(AllreducePacket* ar, AllreduceInfo* ar_info_local){
-    ar_info_local->stash.hdr.id = ar->hdr.id;  
-    for (uint32_t i = 0; i < ar->hdr.num_values; i++){
-        uint32_t hidx = ar->index[i] % HASH_SIZE;
+#if DEFERRED_FLUSH
+#define AR_FLUSH_CHUNKS(info) ((AR_BLOCK_RANGE(info) + FLUSH_CHUNK - 1) / FLUSH_CHUNK)
 
-        #if VALUES_PER_ELEMENT == 1
-        //printf("Idx %d data %d index %d\n", hidx, ar_info_local->data[hidx], ar_info_local->index[hidx]);
-        if(ar_info_local->data[hidx] == 0){
-            ar_info_local->data[hidx] = (ar->data)[i];
-            ar_info_local->index[hidx] = ar->index[i];
-        }else if(ar_info_local->index[hidx] == ar->index[i]){
-            ar_info_local->data[hidx] += (ar->data)[i];
-        }
-        #if HASH_LINEAR_PROBE == 1
-        else if(ar_info_local->data[(hidx + 1) % HASH_SIZE] == 0){
-            ar_info_local->data[(hidx + 1) % HASH_SIZE] = (ar->data)[i];
-            ar_info_local->index[(hidx + 1) % HASH_SIZE] = ar->index[i];
-        } else if(ar_info_local->index[(hidx + 1) % HASH_SIZE] == ar->index[i]){
-            ar_info_local->data[(hidx + 1) % HASH_SIZE] += (ar->data)[i];
+// Sends chunk c of the queued block with packets that do not close it. The handler that completes the
+// last chunk sends the header-only packet carrying the number of packets.
+static  __attribute__((always_inline)) inline void flush_chunk(uint32_t c, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    uint32_t start = c * FLUSH_CHUNK;
+    uint32_t end = (start + FLUSH_CHUNK < AR_BLOCK_RANGE(ar_info_local)) ? start + FLUSH_CHUNK : AR_BLOCK_RANGE(ar_info_local);
+#if DEBUG
+    printf("Flushing chunk %d of block id %d\n", c, ar_info_local->flush_id);
+#endif
+    send_range(ar_info_local->flush_id, start, end, 0, 0, ar_info_local, out_buffer);
+    if(amo_add(&(ar_info_local->flush_done), 1) + 1 == AR_FLUSH_CHUNKS(ar_info_local)){ // The other chunks already counted what they sent
+        send_range(ar_info_local->flush_id, end, end, ar_info_local->flush_sent, 1, ar_info_local, out_buffer);
+#if COALESCE_OUTPUT
+        coalesce_close(ar_info_local->coalescer); // The queued block stayed open until its last chunk
+#endif
+        ar_info_local->flush_pending = 0;
+    }
+}
+#endif
+
+#if STREAM_FLUSH
+// Counts packet ar of its port and sends the indices that became final for all the ports, if enough of them
+static  __attribute__((always_inline)) inline void stream_advance(AllreducePacket* ar, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    PortStream* port = &(ar_info_local->stream[ar->hdr.port]);
+    if(ar->hdr.seq >= port->top){
+        port->top = ar->hdr.seq + 1;
+        if(ar->hdr.block_split_num){ // Nothing else comes from the port
+            port->top_end = AR_BLOCK_RANGE(ar_info_local);
+        }else if(ar->hdr.num_values){
+            port->top_end = AR_BLOCK_INDEX(ar, AR_PKT_INDEX(ar)[ar->hdr.num_values - 1]) + 1;
         }
-        #endif
-        else{
-            // Collision, put it in the output packet
-            ar_info_local->stash.index[ar_info_local->stash.hdr.num_values] = (ar->index)[i];
-            ar_info_local->stash.data[ar_info_local->stash.hdr.num_values] = (ar->data)[i];
-            if(++ar_info_local->stash.hdr.num_values == MAX_DATA_ELEMENTS){
-                ar_info_local->stash.hdr.block_split_num = 0;
-		        ++ar_info_local->subblocks_out_sent;
-                spin_cmd_t handle;
-                spin_send_packet(&(ar_info_local->stash), PKT_SIZE, &handle); // Send to the next level of the tree            
-                ar_info_local->stash.hdr.num_values = 0;
+    }
+    if(++port->recvd != port->top || port->high_water == port->top_end){
+        return; // A packet below the highest seq is still missing, or nothing changed
+    }
+    port->high_water = port->top_end;
+    uint32_t low = port->high_water;
+    for(uint32_t p = 0; p < AR_CHILDREN(ar_info_local); p++){
+        if(ar_info_local->stream[p].high_water < low){
+            low = ar_info_local->stream[p].high_water;
+        }
+    }
+    if(low >= ar_info_local->stream_flushed + STREAM_FLUSH_MIN){
+#if DEBUG
+        printf("Streaming indices %d to %d of block id %d\n", ar_info_local->stream_flushed, low, ar->hdr.id);
+#endif
+        ar_info_local->stream_sent = send_range(ar->hdr.id, ar_info_local->stream_flushed, low, ar_info_local->stream_sent, 0, ar_info_local, out_buffer);
+        ar_info_local->stream_flushed = low;
+    }
+}
+#endif
+#elif STORAGE_TYPE == STORAGE_TYPE_HASH
+// Sends the stash as a packet that does not close the block
+static  __attribute__((always_inline)) inline void stash_send(AllreduceInfo* ar_info_local){
+#if DEBUG
+    printf("Sending pkt with %d elements id %d\n", ar_info_local->stash.pkt.hdr.num_values, ar_info_local->stash.pkt.hdr.id);
+#endif
+    ar_info_local->stash.pkt.hdr.block_split_num = 0;
+    ar_info_local->stash.pkt.hdr.seq = AR_OUT_SEQ(ar_info_local, ar_info_local->subblocks_out_sent++);
+    AR_PKT_COMPACT(&(ar_info_local->stash.pkt));
+    spin_cmd_t handle;
+    AR_SEND_OUT(&(ar_info_local->stash), AR_WIRE_LEN(AR_PKT_LEN(ar_info_local->stash.pkt.hdr.num_values)), &handle, ar_info_local); // Send to the next level of the tree
+    ar_info_local->stash.pkt.hdr.num_values = 0;
+}
+
+// Appends one element (VALUES_PER_ELEMENT values) to the stash, which is sent once full. With INDEX_TYPE_BASE16
+// an element outside the window of the stash sends it early.
+static  __attribute__((always_inline)) inline void stash_push(AllreduceInfo* ar_info_local, AR_BLOCK_INDEX_NAME index, AR_TYPE_NAME* value){
+    AllreducePacket* stash = &(ar_info_local->stash.pkt);
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+    // Elements arrive in hash order, aligned windows avoid early sends whenever the block fits in one
+    uint32_t base = index & ~(AR_BASE_WINDOW - 1);
+    if(stash->hdr.num_values && stash->base != base){
+        stash_send(ar_info_local);
+    }
+    stash->base = base;
+    stash->index[stash->hdr.num_values] = index - base;
+#else
+    stash->index[stash->hdr.num_values] = index;
+#endif
+    for(uint32_t v = 0; v < VALUES_PER_ELEMENT; v++){
+        stash->data[VALUES_PER_ELEMENT * stash->hdr.num_values + v] = value[v];
+    }
+    if(++stash->hdr.num_values == MAX_DATA_ELEMENTS){
+        stash_send(ar_info_local);
+    }
+}
+
+// Adds one element (VALUES_PER_ELEMENT values) to the hash table, or to the stash on collision
+static  __attribute__((always_inline)) inline void hash_insert(AllreduceInfo* ar_info_local, AR_BLOCK_INDEX_NAME index, AR_TYPE_NAME* value){
+    uint32_t hidx = AR_HASH_MOD(ar_info_local, index);
+
+    #if VALUES_PER_ELEMENT == 1
+    //printf("Idx %d data %d index %d\n", hidx, ar_info_local->data[hidx], ar_info_local->index[hidx]);
+    if(ar_info_local->data[hidx] == 0){
+        ar_info_local->data[hidx] = value[0];
+        ar_info_local->index[hidx] = index;
+    }else if(ar_info_local->index[hidx] == index){
+        ar_info_local->data[hidx] += value[0];
+    }
+    #if HASH_LINEAR_PROBE == 1
+    else if(ar_info_local->data[AR_HASH_MOD(ar_info_local, hidx + 1)] == 0){
+        ar_info_local->data[AR_HASH_MOD(ar_info_local, hidx + 1)] = value[0];
+        ar_info_local->index[AR_HASH_MOD(ar_info_local, hidx + 1)] = index;
+    } else if(ar_info_local->index[AR_HASH_MOD(ar_info_local, hidx + 1)] == index){
+        ar_info_local->data[AR_HASH_MOD(ar_info_local, hidx + 1)] += value[0];
+    }
+    #endif
+    else{
+        // Collision, put it in the output packet
+#if TOPK_ELEMENTS > 0
+        ++ar_info_local->topk_stashed;
+#endif
+        stash_push(ar_info_local, index, value);
+    }
+
+    #elif VALUES_PER_ELEMENT == 2
+    if(ar_info_local->data[2 * hidx] == 0 && ar_info_local->data[2 * hidx + 1] == 0){
+        ar_info_local->data[2 * hidx] = value[0];
+        ar_info_local->data[2 * hidx + 1] = value[1];
+        ar_info_local->index[hidx] = index;
+    }else if(ar_info_local->index[hidx] == index){
+        ar_info_local->data[2 * hidx] += value[0];
+        ar_info_local->data[2 * hidx + 1] += value[1];
+    }
+    #if HASH_LINEAR_PROBE == 1
+    else if(ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1))] == 0 && ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1)) + 1] == 0){
+        ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1))] = value[0];
+        ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1)) + 1] = value[1];
+        ar_info_local->index[(AR_HASH_MOD(ar_info_local, hidx + 1))] = index;
+    }else if(ar_info_local->index[(AR_HASH_MOD(ar_info_local, hidx + 1))] == index){
+        ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1))] += value[0];
+        ar_info_local->data[2 * (AR_HASH_MOD(ar_info_local, hidx + 1)) + 1] += value[1];
+    }
+    #endif
+    else{
+        // Collision, put it in the output packet
+#if TOPK_ELEMENTS > 0
+        ++ar_info_local->topk_stashed;
+#endif
+        stash_push(ar_info_local, index, value);
+    }
+    #endif
+}
+
+static  __attribute__((always_inline)) inline void aggregate_block(AllreducePacket* ar, AllreduceInfo* ar_info_local){
+    ar_info_local->stash.pkt.hdr.id = ar->hdr.id;  
+    ar_info_local->stash.pkt.hdr.flags = 0;
+    ar_info_local->stash.pkt.hdr.version = AR_PKT_VERSION;
+    ar_info_local->stash.pkt.hdr.port = 0;
+    ar_info_local->stash.pkt.hdr.coll_id = ar->hdr.coll_id;
+#if DENSE_OUTPUT == 1
+    if(ar->hdr.flags & AR_FLAG_DENSE){
+        AllreduceDensePacket* ar_dense = (AllreduceDensePacket*) ar;
+        for (uint32_t i = 0; i < ar_dense->hdr.num_values; i++){
+            if((ar_dense->data)[i]){
+                hash_insert(ar_info_local, ar_dense->start + i, &(ar_dense->data)[i]);
             }
         }
+        return;
+    }
+#endif
+    const ar_word_t* index_words = (const ar_word_t*) AR_PKT_INDEX(ar);
+    const ar_word_t* value_words = (const ar_word_t*) ar->data;
+    uint32_t steps = ar->hdr.num_values / AR_STEP_ELEMENTS;
+    for(uint32_t s = 0; s < steps; s++){
+        IndexStep index;
+        ValueStep values;
+        load_step(index_words, value_words, s, &index, &values);
+        for(uint32_t k = 0; k < AR_STEP_ELEMENTS; k++){
+            hash_insert(ar_info_local, AR_BLOCK_INDEX(ar, index.lanes[k]), &values.lanes[VALUES_PER_ELEMENT * k]);
+        }
+    }
+    // Elements left over after the last full step
+    AR_INDEX_NAME* indexes = AR_PKT_INDEX(ar);
+    for(uint32_t i = steps * AR_STEP_ELEMENTS; i < ar->hdr.num_values; i++){
+        hash_insert(ar_info_local, AR_BLOCK_INDEX(ar, indexes[i]), &(ar->data)[VALUES_PER_ELEMENT * i]);
+    }
+}
+
+#if FORWARD_WHOLE
+// Sends a packet that holds a whole block as it is, with the header of an output packet of the slot
+static  __attribute__((always_inline)) inline void send_whole(void* frame, AllreducePacket* pkt, uint32_t id, AllreduceInfo* ar_info_local, spin_cmd_t* handle){
+#if DEBUG
+    printf("Sending block %d as it arrived, %d elements\n", id, pkt->hdr.num_values);
+#endif
+    pkt->hdr.id = id;
+    pkt->hdr.flags = AR_OUT_FLAGS(ar_info_local);
+    AR_OUT_CHILDREN(&(pkt->hdr), ar_info_local);
+    pkt->hdr.version = AR_PKT_VERSION;
+    pkt->hdr.coll_id = ar_info_local->coll_id;
+    pkt->hdr.port = 0;
+    pkt->hdr.seq = 0;
+    pkt->hdr.block_split_num = 1;
+    AR_SEND_OUT(frame, AR_WIRE_LEN(AR_PKT_LEN(pkt->hdr.num_values)), handle, ar_info_local); // Send to the next level of the tree
+}
+#endif
 
+static  __attribute__((always_inline)) inline void flush_block(uint32_t id, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    ar_info_local->stash.pkt.hdr.id = id; // Not set by aggregate_block if only empty packets arrived
+    ar_info_local->stash.pkt.hdr.flags = AR_OUT_FLAGS(ar_info_local);
+    AR_OUT_CHILDREN(&(ar_info_local->stash.pkt.hdr), ar_info_local);
+    ar_info_local->stash.pkt.hdr.version = AR_PKT_VERSION;
+    ar_info_local->stash.pkt.hdr.port = 0;
+    ar_info_local->stash.pkt.hdr.coll_id = ar_info_local->coll_id;
+#if DEBUG
+    printf("Flushing block id %d\n", id);
+#endif
+#if TOPK_ELEMENTS > 0
+    // Collisions already left through the stash, the selection applies to the table with what is left of k
+    uint32_t hist[TOPK_NUM_BUCKETS] = {0};
+    uint32_t dropped = 0;
+    for(size_t i = 0; i < AR_HASH_SIZE(ar_info_local); i++){
+        #if VALUES_PER_ELEMENT == 1
+        if(ar_info_local->data[i]){
+            ++hist[TOPK_BUCKET(topk_key(ar_info_local->data[i]))];
+        }
         #elif VALUES_PER_ELEMENT == 2
-        if(ar_info_local->data[2 * hidx] == 0 && ar_info_local->data[2 * hidx + 1] == 0){
-            ar_info_local->data[2 * hidx] = (ar->data)[2 * i];
-            ar_info_local->data[2 * hidx + 1] = (ar->data)[2 * i  + 1];
-            ar_info_local->index[hidx] = ar->index[i];
-        }else if(ar_info_local->index[hidx] == ar->index[i]){
-            ar_info_local->data[2 * hidx] += (ar->data)[2 * i];
-            ar_info_local->data[2 * hidx + 1] += (ar->data)[2 * i  + 1];
-        }
-        #if HASH_LINEAR_PROBE == 1
-        else if(ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE)] == 0 && ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE) + 1] == 0){
-            ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE)] = (ar->data)[2 * i];
-            ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE) + 1] = (ar->data)[2 * i  + 1];
-            ar_info_local->index[((hidx + 1) % HASH_SIZE)] = ar->index[i];
-        }else if(ar_info_local->index[((hidx + 1) % HASH_SIZE)] == ar->index[i]){
-            ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE)] += (ar->data)[2 * i];
-            ar_info_local->data[2 * ((hidx + 1) % HASH_SIZE) + 1] += (ar->data)[2 * i  + 1];
+        if(ar_info_local->data[2 * i] || ar_info_local->data[2 * i + 1]){
+            uint32_t k0 = topk_key(ar_info_local->data[2 * i]), k1 = topk_key(ar_info_local->data[2 * i + 1]);
+            ++hist[TOPK_BUCKET(k0 > k1 ? k0 : k1)];
         }
         #endif
-        else{
-            // Collision, put it in the output packet
-            ar_info_local->stash.index[ar_info_local->stash.hdr.num_values] = (ar->index)[i];
-            ar_info_local->stash.data[2 * ar_info_local->stash.hdr.num_values] = (ar->data)[2 * i];
-            ar_info_local->stash.data[2 * ar_info_local->stash.hdr.num_values + 1] = (ar->data)[2 * i  + 1];
-            if(++ar_info_local->stash.hdr.num_values == MAX_DATA_ELEMENTS){
-                ar_info_local->stash.hdr.block_split_num = 0;
-		        ++ar_info_local->subblocks_out_sent;
-                spin_cmd_t handle;
-                spin_send_packet(&(ar_info_local->stash), PKT_SIZE, &handle); // Send to the next level of the tree            
-                ar_info_local->stash.hdr.num_values = 0;
-            }
+    }
+    TopkThreshold thr;
+    topk_threshold(hist, topk_want(ar_info_local->topk_stashed), &thr);
+    ar_info_local->topk_stashed = 0;
+    uint32_t sub_hist[TOPK_NUM_SUBS] = {0};
+    for(size_t i = 0; i < AR_HASH_SIZE(ar_info_local); i++){
+        #if VALUES_PER_ELEMENT == 1
+        if(ar_info_local->data[i]){
+            topk_count_sub(sub_hist, topk_key(ar_info_local->data[i]), &thr);
+        }
+        #elif VALUES_PER_ELEMENT == 2
+        if(ar_info_local->data[2 * i] || ar_info_local->data[2 * i + 1]){
+            uint32_t k0 = topk_key(ar_info_local->data[2 * i]), k1 = topk_key(ar_info_local->data[2 * i + 1]);
+            topk_count_sub(sub_hist, k0 > k1 ? k0 : k1, &thr);
         }
         #endif
     }
-}
-
-static  __attribute__((always_inline)) inline void flush_block(AllreducePacket* ar, AllreduceInfo* ar_info_local, u_char* out_buffer){
-#if DEBUG
-    printf("Flushing block id %d\n", ar->hdr.id);
+    topk_refine(sub_hist, &thr);
 #endif
-    for(size_t i = 0; i < HASH_SIZE; i++){
+    for(size_t i = 0; i < AR_HASH_SIZE(ar_info_local); i++){
         #if VALUES_PER_ELEMENT == 1
         if(ar_info_local->data[i]){
-            ar_info_local->stash.index[ar_info_local->stash.hdr.num_values] = ar_info_local->index[i];
-            ar_info_local->stash.data[ar_info_local->stash.hdr.num_values] = ar_info_local->data[i];
+#if TOPK_ELEMENTS > 0
+            if(!topk_keep(topk_key(ar_info_local->data[i]), &thr)){
+                ar_info_local->data[i] = 0;
+                ar_info_local->index[i] = 0;
+                ++dropped;
+                continue;
+            }
+#endif
+            stash_push(ar_info_local, ar_info_local->index[i], &(ar_info_local->data[i]));
             ar_info_local->data[i] = 0; // We set it to zero for when the buffer will be reused
             ar_info_local->index[i] = 0; // We set it to zero for when the buffer will be reused
         #elif VALUES_PER_ELEMENT == 2
         if(ar_info_local->data[2 * i] || ar_info_local->data[2 * i + 1]){
-            ar_info_local->stash.index[ar_info_local->stash.hdr.num_values] = ar_info_local->index[i];
-            ar_info_local->stash.data[2 * ar_info_local->stash.hdr.num_values] = ar_info_local->data[2 * i];
-            ar_info_local->stash.data[2 * ar_info_local->stash.hdr.num_values + 1] = ar_info_local->data[2 * i + 1];
+#if TOPK_ELEMENTS > 0
+            uint32_t k0 = topk_key(ar_info_local->data[2 * i]), k1 = topk_key(ar_info_local->data[2 * i + 1]);
+            if(!topk_keep(k0 > k1 ? k0 : k1, &thr)){
+                ar_info_local->data[2 * i] = 0;
+                ar_info_local->data[2 * i + 1] = 0;
+                ar_info_local->index[i] = 0;
+                ++dropped;
+                continue;
+            }
+#endif
+            stash_push(ar_info_local, ar_info_local->index[i], &(ar_info_local->data[2 * i]));
             ar_info_local->data[2 * i] = 0; // We set it to zero for when the buffer will be reused
             ar_info_local->data[2 * i + 1] = 0;
             ar_info_local->index[i] = 0; // We set it to zero for when the buffer will be reused
         #endif
-            if(++ar_info_local->stash.hdr.num_values == MAX_DATA_ELEMENTS){
-                spin_cmd_t handle;
-#if DEBUG
-                printf("Sending full pkt id %d\n", ar->hdr.id);
-#endif            
-                ++ar_info_local->subblocks_out_sent;
-                spin_send_packet(&(ar_info_local->stash), PKT_SIZE, &handle); // Send to the next level of the tree            
-                ar_info_local->stash.hdr.num_values = 0;
-            }
-        }        
+        }
     }
-    if(ar_info_local->stash.hdr.num_values){
-        spin_cmd_t handle;
+    // Always sent, as it carries the number of packets the block was split in
+    spin_cmd_t handle;
 #if DEBUG
-        printf("Sending pkt with %d elements id %d\n", ar_info_local->stash.hdr.num_values, ar->hdr.id);
+    printf("Sending pkt with %d elements id %d\n", ar_info_local->stash.pkt.hdr.num_values, id);
 #endif            
-        ar_info_local->stash.hdr.block_split_num = ++ar_info_local->subblocks_out_sent;       
-        spin_send_packet(&(ar_info_local->stash), PKT_SIZE - (AR_TYPE_SIZE*(MAX_DATA_ELEMENTS - ar_info_local->stash.hdr.num_values)), &handle); // Send to the next level of the tree            
-        ar_info_local->stash.hdr.num_values = 0;
-    }    
+    ar_info_local->stash.pkt.hdr.seq = AR_OUT_SEQ(ar_info_local, ar_info_local->subblocks_out_sent);
+    ar_info_local->stash.pkt.hdr.block_split_num = ++ar_info_local->subblocks_out_sent;       
+    AR_PKT_COMPACT(&(ar_info_local->stash.pkt));
+    AR_SEND_OUT(&(ar_info_local->stash), AR_WIRE_LEN(AR_PKT_LEN(ar_info_local->stash.pkt.hdr.num_values)), &handle, ar_info_local); // Send to the next level of the tree            
+    ar_info_local->stash.pkt.hdr.num_values = 0;
+#if TOPK_ELEMENTS > 0 && TOPK_REPORT == 1
+    printf("TOPK block %d dropped %d values\n", id, dropped);
+#endif
     ar_info_local->subblocks_out_sent = 0;
     ar_info_local->num_children = 0;
 }
 #endif
 
+#if DROP_DUPLICATES
+// Marks the chunk of ar as received, returns 0 for duplicates (called with the slot lock held)
+static  __attribute__((always_inline)) inline int chunk_mark(AllreducePacket* ar, AllreduceInfo* ar_info_local){
+    uint32_t* word = &(ar_info_local->chunks_recvd[ar->hdr.port][ar->hdr.seq / 32]);
+    uint32_t bit = 1u << (ar->hdr.seq % 32);
+    if(!AR_DROP_DUPLICATES(ar_info_local)){
+        return ar->hdr.id >= ar_info_local->next_id;
+    }
+    if(ar->hdr.id < ar_info_local->next_id || (*word & bit)){
+        return 0;
+    }
+    *word |= bit;
+    return 1;
+}
+#else
+static  __attribute__((always_inline)) inline int chunk_mark(AllreducePacket* ar, AllreduceInfo* ar_info_local){
+    return ar->hdr.id >= ar_info_local->next_id;
+}
+#endif
+
+// The first AR_L1_SLOTS slots of a cluster are in its scratchpad, the others in its share of L2
+static  __attribute__((always_inline)) inline AllreduceInfo* slot_info(task_t* task, volatile int8_t* local_mem, uint32_t cluster_id, size_t offset){
+    if(offset < AR_L1_SLOTS){
+        return (AllreduceInfo*) (local_mem + AR_L1_HEAD + AR_SLOT_STRIDE*offset);
+    }
+    return (AllreduceInfo*) ((int8_t*) task->handler_mem + AR_L2_HEAD + AR_SLOT_STRIDE*(AR_L2_SLOTS*cluster_id + offset - AR_L1_SLOTS));
+}
+
+#if AR_STATS
+static  __attribute__((always_inline)) inline AllreduceStats* cluster_stats(task_t* task, uint32_t cluster_id){
+    return (AllreduceStats*) ((int8_t*) task->handler_mem + AR_L2_CONFIG_SIZE) + cluster_id;
+}
+
+// Only at flushes, so the host sees the counters as of the last block of the cluster
+static  __attribute__((always_inline)) inline void stats_flush(task_t* task, uint32_t cluster_id){
+    AllreduceStats* stats = cluster_stats(task, cluster_id);
+    amo_add(&(stats->flushes), 1);
+    uint64_t host_address = ((uint64_t) task->host_mem_high << 32) | task->host_mem_low;
+    spin_cmd_t handle;
+    spin_dma_to_host(host_address + sizeof(AllreduceStats)*cluster_id, (uint32_t) stats, sizeof(AllreduceStats), 0, &handle);
+}
+#endif
+
+#if PHASE_CYCLES
+_Static_assert(AR_L2_STATS_SIZE <= AR_CYCLES_HOST_OFFSET && AR_CYCLES_HOST_OFFSET + AR_L2_CYCLES_SIZE <= AR_ROOT_HOST_OFFSET, "The counters overlap in host memory");
+
+// Only the handler running on the HPU touches its counters, no atomics needed
+static  __attribute__((always_inline)) inline PhaseCycles* hpu_cycles(task_t* task, uint32_t cluster_id, uint32_t hpu_id){
+    return (PhaseCycles*) ((int8_t*) task->handler_mem + AR_L2_CONFIG_SIZE + AR_L2_STATS_SIZE) + cluster_id * AR_OUT_BUFFERS + hpu_id;
+}
+
+// Charges the cycles since the last phase change of the HPU to phase
+static  __attribute__((always_inline)) inline void phase_mark(PhaseCycles* counters, uint32_t phase){
+    uint32_t now = cycles_now();
+    counters->cycles[phase] += now - counters->last;
+    counters->last = now;
+}
+
+// After the last mark of the handler, so the DMA is not charged to any phase. It is not waited for.
+static  __attribute__((always_inline)) inline void phase_end(task_t* task, uint32_t cluster_id, uint32_t hpu_id){
+    PhaseCycles* counters = hpu_cycles(task, cluster_id, hpu_id);
+    counters->pkts++;
+    uint64_t host_address = ((uint64_t) task->host_mem_high << 32) | task->host_mem_low;
+    spin_cmd_t handle;
+    spin_dma_to_host(host_address + AR_CYCLES_HOST_OFFSET + sizeof(PhaseCycles)*(cluster_id * AR_OUT_BUFFERS + hpu_id), (uint32_t) counters, sizeof(PhaseCycles), 0, &handle);
+}
+
+#define PHASE_START(task, cluster_id, hpu_id) (hpu_cycles((task), (cluster_id), (hpu_id))->last = cycles_now())
+#define PHASE_MARK(task, cluster_id, hpu_id, phase) phase_mark(hpu_cycles((task), (cluster_id), (hpu_id)), (phase))
+#define PHASE_END(task, cluster_id, hpu_id) phase_end((task), (cluster_id), (hpu_id))
+#else
+#define PHASE_START(task, cluster_id, hpu_id)
+#define PHASE_MARK(task, cluster_id, hpu_id, phase)
+#define PHASE_END(task, cluster_id, hpu_id)
+#endif
+
+// Called once block id left the slot: later packets of it are duplicates
+static  __attribute__((always_inline)) inline void slot_reset(uint32_t id, AllreduceInfo* ar_info_local){
+    ar_info_local->next_id = id + 1;
+    ar_info_local->subblocks_in_expected = 0;
+    ar_info_local->subblocks_in_recvd = 0;
+#if PRE_REDUCE
+    ar_info_local->pre_pending = 0;
+#endif
+#if DROP_DUPLICATES
+    memset(ar_info_local->chunks_recvd, 0, sizeof(ar_info_local->chunks_recvd[0]) * AR_CHILDREN(ar_info_local));
+#endif
+#if STREAM_FLUSH
+    ar_info_local->stream_flushed = 0;
+    ar_info_local->stream_sent = 0;
+    memset(ar_info_local->stream, 0, sizeof(PortStream) * AR_CHILDREN(ar_info_local));
+#endif
+}
+
+#if DEFERRED_FLUSH
+// Queues block id of the slot instead of flushing it, the slot takes no values until flush_drain sent it all
+static  __attribute__((always_inline)) inline void flush_enqueue(volatile int8_t* local_mem, size_t offset, uint32_t id, AllreduceInfo* ar_info_local){
+    volatile FlushQueue* queue = AR_L1_QUEUE(local_mem);
+    ar_info_local->flush_pending = 1;
+    ar_info_local->flush_id = id;
+    ar_info_local->flush_done = 0;
+    ar_info_local->flush_sent = 0;
+    ar_info_local->num_children = 0;
+    uint32_t entry = amo_add(&(queue->tail), 1);
+    // A handler that read an older entry of this slot may still claim on it. The claim word is published last
+    // and in one store, so a claim sees either the exhausted old block or the new block with its fields in place.
+    __sync_synchronize();
+    ((volatile AllreduceInfo*) ar_info_local)->flush_next = AR_FLUSH_CLAIM_TAG(entry);
+    queue->offset[entry % AR_FLUSH_QUEUE_LEN] = offset;
+    queue->seq[entry % AR_FLUSH_QUEUE_LEN] = entry + 1;
+}
+
+// Sends chunks of the queued blocks of the cluster until there are none left to hand out
+static  __attribute__((always_inline)) inline void flush_drain(task_t* task, volatile int8_t* local_mem, uint32_t cluster_id, u_char* out_buffer){
+    volatile FlushQueue* queue = AR_L1_QUEUE(local_mem);
+    while(1){
+        uint32_t entry = queue->head;
+        if(entry == queue->tail || queue->seq[entry % AR_FLUSH_QUEUE_LEN] != entry + 1){
+            return; // Empty, or its producer is still writing it and will drain it itself
+        }
+        AllreduceInfo* ar_info_local = slot_info(task, local_mem, cluster_id, queue->offset[entry % AR_FLUSH_QUEUE_LEN]);
+        uint32_t claim = amo_add(&(ar_info_local->flush_next), 1);
+        uint32_t c = AR_FLUSH_CLAIM_CHUNK(claim);
+        if(c < AR_FLUSH_CHUNKS(ar_info_local)){
+            flush_chunk(c, ar_info_local, out_buffer); // Of the block the slot holds now, which the claim kept open
+        }
+        if(c >= AR_FLUSH_CHUNKS(ar_info_local) || claim - c != AR_FLUSH_CLAIM_TAG(entry)){
+            amo_maxu(&(queue->head), entry + 1); // All its chunks are taken or the slot already queued another block
+        }
+    }
+}
+#endif
+
+#if STRAGGLER_TIMEOUT > 0
+// Packets of a block flushed by timeout are forwarded unreduced as late packets. A parent that still has the
+// block open adds them, otherwise they keep going up and the top of the tree delivers them to the host, which
+// adds them to the partial result.
+static  __attribute__((always_inline)) inline void forward_late(task_t* task, AllreducePacket* ar){
+#if DEBUG
+    printf("Forwarding late packet of block %d from port %d\n", ar->hdr.id, ar->hdr.port);
+#endif
+    ar->hdr.flags |= AR_FLAG_LATE;
+    spin_cmd_t handle;
+    spin_send_packet(task->pkt_mem, task->pkt_mem_size, &handle);
+}
+
+// Adds a late packet to its block if the block is still open here. It is not counted, the child that sent it
+// already completed. Returns 0 if the packet has to keep going up.
+static  __attribute__((always_inline)) inline int late_add(volatile uint32_t* lock, AllreducePacket* ar, AllreduceInfo* ar_info_local){
+    spin_lock_lock(lock);
+    int open = ar_info_local->first_arrival && ar_info_local->id == ar->hdr.id;
+    if(open && ar->hdr.num_values){
+        aggregate_block(ar, ar_info_local);
+    }
+    spin_lock_unlock(lock);
+    return open;
+}
+
+static  __attribute__((always_inline)) inline void flush_partial(AllreduceInfo* ar_info_local, u_char* out_buffer){
+#if DEBUG
+    printf("Block %d timed out with children 0x%x\n", ar_info_local->id, ar_info_local->children_done);
+#endif
+    ar_info_local->partial_id = ar_info_local->id + 1;
+    flush_block(ar_info_local->id, ar_info_local, out_buffer);
+    slot_reset(ar_info_local->id, ar_info_local);
+    ar_info_local->first_arrival = 0;
+    ar_info_local->children_done = 0;
+}
+
+// There is no periodic handler, so each packet checks one slot of its cluster for a timed out block. A block is
+// flushed once its timeout passed and the cursor comes back to its slot, which takes up to NUM_MAX_FLYING_PACKETS
+// more packets of the cluster: the delay depends on the traffic, without any a block never times out.
+static  __attribute__((always_inline)) inline void straggler_sweep(task_t* task, volatile int8_t* local_mem, uint32_t cluster_id, u_char* out_buffer){
+    volatile uint32_t* cursor = AR_L1_CURSOR(local_mem);
+    uint32_t offset = (*cursor)++ % NUM_MAX_FLYING_PACKETS; // Racy, at worst a slot is checked twice
+    volatile uint32_t* lock = AR_L1_LOCK(local_mem, offset);
+    AllreduceInfo* ar_info_local = slot_info(task, local_mem, cluster_id, offset);
+    if(!spin_lock_try_lock(lock)){
+        return; // Busy slots are making progress
+    }
+    if(ar_info_local->first_arrival && (int32_t) (cycles_now() - ar_info_local->first_arrival) > STRAGGLER_TIMEOUT){ // Signed, first_arrival may be one cycle ahead
+        flush_partial(ar_info_local, out_buffer);
+#if AR_STATS
+        stats_flush(task, cluster_id);
+#endif
+    }
+    spin_lock_unlock(lock);
+}
+#endif
+
+// Counts packet ar in its slot, with the lock of the slot held, and flushes the block after its last packet
+static  __attribute__((always_inline)) inline void slot_update(task_t* task, uint32_t cluster_id, uint32_t hpu_id, volatile int8_t* local_mem, size_t offset, AllreducePacket* ar, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    if(!chunk_mark(ar, ar_info_local)){
+#if DEBUG
+        printf("Dropping duplicate packet %d of block %d from port %d\n", ar->hdr.seq, ar->hdr.id, ar->hdr.port);
+#endif
+        return;
+    }
+    ar_info_local->coll_id = ar->hdr.coll_id;
+#if STRAGGLER_TIMEOUT > 0
+    if(!ar_info_local->first_arrival){
+        ar_info_local->id = ar->hdr.id;
+        ar_info_local->first_arrival = cycles_now() | 1; // Never 0, that marks an idle slot
+    }
+#endif
+
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_BOOKKEEPING);
+#if FORWARD_WHOLE
+    // The block is this packet alone, it leaves from the packet buffer
+    int sole = AR_CHILDREN(ar_info_local) == 1 && ar->hdr.block_split_num == 1 && !(ar->hdr.flags & AR_FLAG_DENSE);
+#else
+    int sole = 0;
+#endif
+    if(ar->hdr.num_values && !sole){ // Header-only packets just complete a child, there is nothing to aggregate
+        aggregate_block(ar, ar_info_local);
+    }
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_AGGREGATE);
+    
+    if(ar->hdr.block_split_num){ // Last packet of its port
+        ar_info_local->subblocks_in_expected += ar->hdr.block_split_num;
+        ar_info_local->num_children += 1;
+#if STRAGGLER_TIMEOUT > 0
+        ar_info_local->children_done |= 1u << ar->hdr.port;
+#endif
+    }
+#if COALESCE_OUTPUT
+    if(!ar_info_local->subblocks_in_recvd){ // First packet of the block
+        amo_add(&(AR_L1_COALESCER(local_mem)->open), 1);
+    }
+#endif
+    ++ar_info_local->subblocks_in_recvd;
+#if DEBUG
+    printf("Num children for id %d: %d\n", ar->hdr.id, ar_info_local->num_children);
+#endif
+
+    if(ar_info_local->num_children == AR_CHILDREN(ar_info_local) && ar_info_local->subblocks_in_recvd == ar_info_local->subblocks_in_expected){ // I am the last one
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_BOOKKEEPING);
+#if FORWARD_WHOLE
+        if(sole){
+            spin_cmd_t handle;
+            send_whole((u_char*) ar - SIZE_IP_UDP_HDRS, ar, ar->hdr.id, ar_info_local, &handle);
+#if MAILBOX_BATCH && BCAST != BCAST_ROOT // send_down returns with its sends complete
+            if((u_char*) ar - SIZE_IP_UDP_HDRS != (u_char*) task->pkt_mem){ // From the mailbox, its handler returns once the entry is cleared
+                spin_cmd_wait(handle);
+            }
+#endif
+            ar_info_local->num_children = 0;
+        }else
+#endif
+#if ROOT_MODE
+        flush_block_root(task, ar->hdr.id, ar->hdr.root_address, ar_info_local);
+#elif DEFERRED_FLUSH
+        flush_enqueue(local_mem, offset, ar->hdr.id, ar_info_local);
+#else
+        flush_block(ar->hdr.id, ar_info_local, out_buffer);
+#endif
+        slot_reset(ar->hdr.id, ar_info_local);
+#if COALESCE_OUTPUT && !DEFERRED_FLUSH
+        coalesce_close(AR_L1_COALESCER(local_mem));
+#endif
+#if AR_STATS
+        stats_flush(task, cluster_id);
+#endif
+#if STRAGGLER_TIMEOUT > 0
+        ar_info_local->first_arrival = 0;
+        ar_info_local->children_done = 0;
+#endif
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_FLUSH);
+    }
+#if STREAM_FLUSH
+    else{
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_BOOKKEEPING);
+        stream_advance(ar, ar_info_local, out_buffer);
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_FLUSH);
+    }
+#endif
+}
+
+#if MAILBOX_BATCH
+// Takes the lock of the slot, or leaves ar in the mailbox of the slot while another handler holds it. Returns 1
+// with the lock held if ar is still to be handled, 0 once the holder handled it.
+static  __attribute__((always_inline)) inline int mailbox_enter(volatile uint32_t* lock, AllreduceInfo* ar_info_local, uint32_t hpu_id, AllreducePacket* ar){
+    if(spin_lock_try_lock(lock)){
+        return 1;
+    }
+    volatile uint32_t* entry = &(ar_info_local->mailbox[hpu_id]);
+    *entry = (uint32_t) ar;
+    while(*entry){
+        if(spin_lock_try_lock(lock)){ // The holder left before it saw ar
+            if(amo_swap(entry, 0)){
+                return 1;
+            }
+            spin_lock_unlock(lock); // It did see it after all
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Handles the packets the other handlers left in the mailbox while the lock was held, until it stays empty
+static  __attribute__((always_inline)) inline void mailbox_drain(task_t* task, uint32_t cluster_id, uint32_t hpu_id, volatile int8_t* local_mem, size_t offset, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    uint32_t found;
+    do{
+        found = 0;
+        for(uint32_t h = 0; h < AR_OUT_BUFFERS; h++){
+            AllreducePacket* pkt = (AllreducePacket*) ar_info_local->mailbox[h];
+            if(pkt){
+                slot_update(task, cluster_id, hpu_id, local_mem, offset, pkt, ar_info_local, out_buffer);
+                ar_info_local->mailbox[h] = 0; // Its handler may return, and its packet buffer go
+                found = 1;
+            }
+        }
+    }while(found);
+}
+#endif
+
+#if PRE_REDUCE
+// Adds the values of ar to the table of the HPU, with its lock held
+static  __attribute__((always_inline)) inline void pre_fold(volatile PreBuffer* pre, AllreducePacket* ar){
+#if DENSE_OUTPUT == 1
+    AllreduceDensePacket* ar_dense = (AllreduceDensePacket*) ar;
+    uint32_t dense = ar->hdr.flags & AR_FLAG_DENSE;
+#endif
+    for(uint32_t i = 0; i < ar->hdr.num_values; i++){
+#if DENSE_OUTPUT == 1
+        uint32_t index = dense ? ar_dense->start + i : AR_BLOCK_INDEX(ar, AR_PKT_INDEX(ar)[i]);
+        AR_TYPE_NAME value = dense ? ar_dense->data[i] : ar->data[i];
+#else
+        uint32_t index = AR_BLOCK_INDEX(ar, AR_PKT_INDEX(ar)[i]);
+        AR_TYPE_NAME value = ar->data[i];
+#endif
+        uint32_t h = index & (PRE_REDUCE_LEN - 1);
+        while(pre->key[h] && pre->key[h] != index + 1){ // Linear probing, the table is at most half full
+            h = (h + 1) & (PRE_REDUCE_LEN - 1);
+        }
+        if(!pre->key[h]){
+            pre->key[h] = index + 1;
+            pre->n++;
+        }
+        pre->data[h] += value;
+    }
+}
+
+// Adds the table of an HPU to its slot and empties it, with the locks of both held
+static  __attribute__((always_inline)) inline void pre_merge(task_t* task, uint32_t cluster_id, volatile PreBuffer* pre, AllreduceInfo* ar_info_local){
+    for(uint32_t h = 0; pre->n && h < PRE_REDUCE_LEN; h++){
+        if(pre->key[h]){
+            ar_info_local->data[AR_SLOT_INDEX(ar_info_local, pre->key[h] - 1)] += pre->data[h];
+            pre->key[h] = 0;
+            pre->data[h] = 0;
+            pre->n--;
+        }
+    }
+#if AR_STATS
+    amo_add(&(cluster_stats(task, cluster_id)->merges), 1);
+#endif
+}
+
+// Folds ar into the table of the HPU. The slot lock is only taken to make room in the table, and by the handler
+// of the last packet of the block, which merges the tables of all the HPUs before it flushes the block.
+static  __attribute__((always_inline)) inline void pre_reduce(task_t* task, uint32_t cluster_id, volatile int8_t* local_mem, size_t offset, uint32_t hpu_id, AllreducePacket* ar, AllreduceInfo* ar_info_local, u_char* out_buffer){
+    volatile PreBuffer* pre = AR_L1_PRE(local_mem, hpu_id);
+    if(ar->hdr.id < ar_info_local->next_id){
+        return; // Late duplicate of a block that already left
+    }
+    ar_info_local->coll_id = ar->hdr.coll_id;
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_BOOKKEEPING);
+    spin_lock_lock(&(pre->lock));
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_LOCK);
+    if(pre->n && (pre->offset != offset || pre->n + ar->hdr.num_values > AR_PRE_REDUCE_FILL)){
+        // The slot lock goes first, as for the handler gathering the tables
+        size_t held = pre->offset;
+        volatile uint32_t* held_lock = AR_L1_LOCK(local_mem, held);
+        spin_lock_unlock(&(pre->lock));
+        spin_lock_lock(held_lock);
+        spin_lock_lock(&(pre->lock));
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_LOCK);
+        if(pre->n){ // Unless the block completed in the meantime and its last handler took the values
+            pre_merge(task, cluster_id, pre, slot_info(task, local_mem, cluster_id, held));
+        }
+        spin_lock_unlock(held_lock);
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_AGGREGATE);
+    }
+    pre->offset = offset;
+    pre_fold(pre, ar);
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_AGGREGATE);
+    // Counted while the lock of the table is held, so the handler gathering the tables waits for the values
+    uint32_t delta = ar->hdr.block_split_num ? (1u << AR_PRE_CHILD_SHIFT) + ar->hdr.block_split_num - 1 : (uint32_t) -1;
+    uint32_t pending = amo_add(&(ar_info_local->pre_pending), delta);
+    spin_lock_unlock(&(pre->lock));
+#if COALESCE_OUTPUT
+    if(!pending){ // First packet of the block
+        amo_add(&(AR_L1_COALESCER(local_mem)->open), 1);
+    }
+#endif
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_BOOKKEEPING);
+    if(pending + delta != ((uint32_t) AR_CHILDREN(ar_info_local) << AR_PRE_CHILD_SHIFT)){
+        return;
+    }
+    volatile uint32_t* lock = AR_L1_LOCK(local_mem, offset);
+    spin_lock_lock(lock);
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_LOCK);
+    for(uint32_t h = 0; h < AR_OUT_BUFFERS; h++){
+        volatile PreBuffer* other = AR_L1_PRE(local_mem, h);
+        spin_lock_lock(&(other->lock));
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_LOCK);
+        if(other->n && other->offset == offset){
+            pre_merge(task, cluster_id, other, ar_info_local);
+        }
+        spin_lock_unlock(&(other->lock));
+        PHASE_MARK(task, cluster_id, hpu_id, PHASE_AGGREGATE);
+    }
+#if ROOT_MODE
+    flush_block_root(task, ar->hdr.id, ar->hdr.root_address, ar_info_local);
+#else
+    flush_block(ar->hdr.id, ar_info_local, out_buffer);
+#endif
+    slot_reset(ar->hdr.id, ar_info_local);
+#if COALESCE_OUTPUT
+    coalesce_close(AR_L1_COALESCER(local_mem));
+#endif
+#if AR_STATS
+    stats_flush(task, cluster_id);
+#endif
+    spin_lock_unlock(lock);
+    PHASE_MARK(task, cluster_id, hpu_id, PHASE_FLUSH);
+}
+#endif
+
 __handler__ void ar_single_sparse_ph(handler_args_t *args){
 #if DEBUG
     printf("Packet handler executed\n");
@@ -189,48 +1310,166 @@ __handler__ void ar_single_sparse_ph(handler_args_t *args){
 
     // Packet
     AllreducePacket* ar = (AllreducePacket*) (task->pkt_mem + SIZE_IP_UDP_HDRS);
+#if DEBUG
+    if(ar->hdr.version != AR_PKT_VERSION){
+        printf("Packet id %d has version %d, expected %d\n", ar->hdr.id, ar->hdr.version, AR_PKT_VERSION);
+    }
+#endif
     // Stored data
     volatile int8_t *local_mem = (int8_t *)(task->scratchpad[args->cluster_id]);
-    size_t offset = ((ar->hdr.id / NUM_CLUSTERS) % NUM_MAX_FLYING_PACKETS);
+    if(ar->hdr.coll_id >= NUM_COLLECTIVES){ // No slots for it
+#if DEBUG
+        printf("Dropping packet of unknown collective %d\n", ar->hdr.coll_id);
+#endif
+        return;
+    }
+    PHASE_START(task, args->cluster_id, args->hpu_id);
+    // Each collective has its own COLL_SLOTS slots, so concurrent allreduces do not share accumulators
+    size_t offset = ar->hdr.coll_id * COLL_SLOTS + (ar->hdr.id / AR_BLOCK_CLUSTERS) % COLL_SLOTS;
 #if DEBUG
-    printf("ID %d offset %d localmem %p speroff %d lock %p hpuid %d\n", ar->hdr.id, offset, local_mem, sizeof(uint32_t)*offset, local_mem + sizeof(uint32_t)*offset, args->hpu_id);
+    printf("ID %d offset %d localmem %p speroff %d lock %p hpuid %d\n", ar->hdr.id, offset, local_mem, sizeof(uint32_t)*LOCK_STRIDE*offset, AR_L1_LOCK(local_mem, offset), args->hpu_id);
 #endif
-    volatile uint32_t* lock = (uint32_t*) (local_mem + sizeof(uint32_t)*offset);
+    volatile uint32_t* lock = AR_L1_LOCK(local_mem, offset);
     // We keep one buffer per core (equal to packet size), for creating the packet to be sent out (would not fit on the stack)
-    //                                                 |-------- locks --------------------------|----- out buffers------|
-    volatile int8_t* out_buffer = (int8_t*) (local_mem + sizeof(uint32_t)*NUM_MAX_FLYING_PACKETS + PKT_SIZE*(args->hpu_id));
-    //                                                         |-------- locks --------------------------|---------- out buffers ---------|------- aggregation data ----|
-    AllreduceInfo* ar_info_local = (AllreduceInfo*) (local_mem + sizeof(uint32_t)*NUM_MAX_FLYING_PACKETS + PKT_SIZE*NUM_CORES_PER_CLUSTER + sizeof(AllreduceInfo)*offset);   
+    volatile int8_t* out_buffer = AR_L1_OUT_BUFFER(local_mem, args->hpu_id);
+    AllreduceInfo* ar_info_local = slot_info(task, local_mem, args->cluster_id, offset);
+#if COALESCE_OUTPUT
+    ar_info_local->coalescer = AR_L1_COALESCER(local_mem);
+#endif
+#if CLUSTER_SPLIT
+    ar_info_local->slice = args->cluster_id; // The driver routes slice c of every block to cluster c
+    ar_info_local->slice_count = (volatile SliceCount*) ((int8_t*) task->handler_mem + AR_L2_CONFIG_SIZE + AR_L2_STATS_SIZE + AR_L2_CYCLES_SIZE) + offset;
+#endif
+#if AR_STATS
+    amo_add(&(cluster_stats(task, args->cluster_id)->pkts), 1);
+    if(offset >= AR_L1_SLOTS){
+        amo_add(&(cluster_stats(task, args->cluster_id)->l2_pkts), 1);
+    }
+#endif
+#if RUNTIME_CONFIG
+    if(((volatile AllreduceConfig*) &ar_info_local->cfg)->magic != AR_CONFIG_MAGIC){
+        volatile AllreduceConfig* cfg = (volatile AllreduceConfig*) task->handler_mem;
+        // A configuration the slots cannot hold would index past them, and AR_HASH_MOD masks with a power of 2.
+        // Nothing is reduced until the host fixes it.
+        if(cfg->magic != AR_CONFIG_MAGIC || !cfg->num_children || cfg->num_children > NUM_CHILDREN || !cfg->block_range || cfg->block_range > BLOCK_RANGE
+                || !cfg->hash_size || cfg->hash_size > HASH_SIZE || (cfg->hash_size & (cfg->hash_size - 1))){
+#if DEBUG
+            printf("Invalid configuration in L2, dropping packet %d of block %d\n", ar->hdr.seq, ar->hdr.id);
+#endif
+#if AR_STATS
+            amo_add(&(cluster_stats(task, args->cluster_id)->malformed), 1);
+#endif
+            PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_BOOKKEEPING);
+            PHASE_END(task, args->cluster_id, args->hpu_id);
+            return;
+        }
+        // The configuration does not change during a run: racing copies write the same values. The fence keeps the
+        // magic behind them, an HPU that sees it reads a complete copy.
+        ar_info_local->cfg.num_children = cfg->num_children;
+        ar_info_local->cfg.block_range = cfg->block_range;
+        ar_info_local->cfg.hash_size = cfg->hash_size;
+        ar_info_local->cfg.dense_output_threshold = cfg->dense_output_threshold;
+        ar_info_local->cfg.flags = cfg->flags;
+        __sync_synchronize();
+        ((volatile AllreduceConfig*) &ar_info_local->cfg)->magic = AR_CONFIG_MAGIC;
+    }
+#endif
 #if DEBUG
     printf("Trying to lock %p\n", lock);
 #endif
-    spin_lock_lock(lock);
+#if STRAGGLER_TIMEOUT > 0
+    if(ar->hdr.flags & AR_FLAG_LATE){ // Forwarded by a child after its block timed out
+        if(!late_add(lock, ar, ar_info_local)){
+            forward_late(task, ar);
+        }
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_FLUSH);
+        PHASE_END(task, args->cluster_id, args->hpu_id);
+        return;
+    }
+#endif
+#if BCAST != BCAST_NONE
+    if(ar->hdr.flags & AR_FLAG_BCAST){ // Result coming down from the parent, nothing to reduce
+        spin_cmd_t handle;
+        send_down(task->pkt_mem, task->pkt_mem_size, &handle, AR_CHILDREN(ar_info_local));
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_FLUSH);
+        PHASE_END(task, args->cluster_id, args->hpu_id);
+        return;
+    }
+#endif
+    // The port indexes the per-port state of the slot and with DROP_DUPLICATES the seq its bitmap, a malformed
+    // packet would write past them. Without it the seq only orders the packets of a port, which may be more.
+    // Coalesced packets are not unpacked, COALESCE_OUTPUT only sends toward a host.
+    if((ar->hdr.flags & AR_FLAG_COALESCED) || ar->hdr.port >= AR_CHILDREN(ar_info_local) || (DROP_DUPLICATES && ar->hdr.seq >= MAX_CHUNKS_PER_PORT)){
 #if DEBUG
-    printf("Locked %p\n", lock);
+        printf("Dropping packet %d of block %d from port %d, out of range\n", ar->hdr.seq, ar->hdr.id, ar->hdr.port);
 #endif
-
-    aggregate_block(ar, ar_info_local);
-    
-    if(ar->hdr.block_split_num){
-        ar_info_local->subblocks_in_expected[ar->hdr.port] = ar->hdr.block_split_num;
+#if AR_STATS
+        amo_add(&(cluster_stats(task, args->cluster_id)->malformed), 1);
+#endif
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_BOOKKEEPING);
+        PHASE_END(task, args->cluster_id, args->hpu_id);
+        return;
     }
-    if(++ar_info_local->subblocks_in_recvd[ar->hdr.port] == ar_info_local->subblocks_in_expected[ar->hdr.port]){
-        ar_info_local->num_children += 1;
-        ar_info_local->subblocks_in_recvd[ar->hdr.port] = 0;
-        ar_info_local->subblocks_in_expected[ar->hdr.port] = 0;
+#if PRE_REDUCE
+    pre_reduce(task, args->cluster_id, local_mem, offset, args->hpu_id, ar, ar_info_local, (u_char*) out_buffer);
+#else
+    PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_BOOKKEEPING);
+#if MAILBOX_BATCH
+    if(!mailbox_enter(lock, ar_info_local, args->hpu_id, ar)){
+#if AR_STATS
+        amo_add(&(cluster_stats(task, args->cluster_id)->batched), 1);
+#endif
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_LOCK);
+        PHASE_END(task, args->cluster_id, args->hpu_id);
+        return; // Handled by the holder of the lock
     }
+#else
+    spin_lock_lock(lock);
+#endif
+    PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_LOCK);
+#if DEFERRED_FLUSH
+    while(ar_info_local->flush_pending){ // The previous block of the slot is still queued, help sending it
+        spin_lock_unlock(lock);
+        flush_drain(task, local_mem, args->cluster_id, (u_char*) out_buffer);
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_FLUSH);
+        spin_lock_lock(lock);
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_LOCK);
+    }
+#endif
 #if DEBUG
-    printf("Num children for id %d: %d\n", ar->hdr.id, ar_info_local->num_children);
+    printf("Locked %p\n", lock);
 #endif
-
-    if(ar_info_local->num_children == NUM_CHILDREN){ // I am the last one
-        flush_block(ar, ar_info_local, (u_char*) out_buffer);
+#if STRAGGLER_TIMEOUT > 0
+    if(ar->hdr.id + 1 == ar_info_local->partial_id){
+        spin_lock_unlock(lock);
+        forward_late(task, ar);
+        PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_FLUSH);
+        PHASE_END(task, args->cluster_id, args->hpu_id);
+        return;
     }
+#endif
+    slot_update(task, args->cluster_id, args->hpu_id, local_mem, offset, ar, ar_info_local, (u_char*) out_buffer);
+#if MAILBOX_BATCH
+    mailbox_drain(task, args->cluster_id, args->hpu_id, local_mem, offset, ar_info_local, (u_char*) out_buffer);
+#endif
     
     spin_lock_unlock(lock);
+    PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_BOOKKEEPING);
 #if DEBUG
     printf("Unlocked %p\n", lock);
 #endif
+#endif
+#if STRAGGLER_TIMEOUT > 0
+    straggler_sweep(task, local_mem, args->cluster_id, (u_char*) out_buffer);
+#endif
+#if DEFERRED_FLUSH
+    flush_drain(task, local_mem, args->cluster_id, (u_char*) out_buffer);
+#endif
+#if COALESCE_OUTPUT
+    coalesce_poll(AR_L1_COALESCER(local_mem));
+#endif
+    PHASE_MARK(task, args->cluster_id, args->hpu_id, PHASE_FLUSH);
+    PHASE_END(task, args->cluster_id, args->hpu_id);
 }
 
 void init_handlers(handler_fn *hh, handler_fn *ph, handler_fn *th, void **handler_mem_ptr)
@@ -1,3 +1,6 @@
+#include <stddef.h>
+#include <stdint.h>
+
 #ifndef NUM_SWITCH_PORTS
 #define NUM_SWITCH_PORTS 16
 #endif
@@ -8,7 +11,40 @@
 #define NUM_BLOCKS 32
 #endif 
 
-#define NUM_MAX_FLYING_PACKETS (NUM_BLOCKS)
+// Independent allreduces served at once (the driver runs one per stream), told apart by hdr.coll_id
+#ifndef NUM_COLLECTIVES
+    #ifdef NUM_STREAMS
+        #define NUM_COLLECTIVES NUM_STREAMS
+    #else
+        #define NUM_COLLECTIVES 1
+    #endif
+#endif
+
+#if NUM_COLLECTIVES > 256
+    #error "coll_id is 8 bit"
+#endif
+
+// With CLUSTER_SPLIT the index range of every block is cut in one slice per cluster, and slice c is routed to
+// cluster c. A few large blocks then keep all the HPUs busy rather than those of the clusters they map to.
+#ifndef CLUSTER_SPLIT
+    #define CLUSTER_SPLIT 0
+#endif
+
+#if CLUSTER_SPLIT
+    #define AR_SLICES 4
+#else
+    #define AR_SLICES 1
+#endif
+#define AR_BLOCK_CLUSTERS (4 / AR_SLICES) // Clusters the blocks are spread over by id
+#define AR_SLOT_RANGE ((BLOCK_RANGE + AR_SLICES - 1) / AR_SLICES) // Indices a slot holds
+
+// Slots each collective gets in every cluster. Blocks are spread over the 4 clusters by id, so by default
+// every block of a collective has its own slot.
+#ifndef COLL_SLOTS
+    #define COLL_SLOTS ((NUM_BLOCKS + AR_BLOCK_CLUSTERS - 1) / AR_BLOCK_CLUSTERS)
+#endif
+
+#define NUM_MAX_FLYING_PACKETS (NUM_COLLECTIVES * COLL_SLOTS)
 #undef PKT_SIZE
 #define PKT_SIZE 1024
 #define STAGGERED_SENDING 1
@@ -23,6 +59,124 @@
 #define STORAGE_TYPE STORAGE_TYPE_DENSE
 #endif
 
+#ifndef DENSE_OUTPUT
+    #define DENSE_OUTPUT 0
+#endif
+
+// Forward only the TOPK_ELEMENTS largest-magnitude values of each flushed block (0 disables the selection)
+// With hash storage, collisions leave through the stash before the block is complete: they count against
+// TOPK_ELEMENTS and only the rest is ranked, but if more than TOPK_ELEMENTS collide they are all still sent.
+#ifndef TOPK_ELEMENTS
+    #define TOPK_ELEMENTS 0
+#endif
+
+// Print how many values each block dropped, for accuracy tracking. Off by default, the printf at every flush
+// would show up in the measured latencies.
+#ifndef TOPK_REPORT
+    #define TOPK_REPORT 0
+#endif
+
+// Hash storage sends the blocks that need no aggregation as they arrived: with a single child, a block that
+// arrives as one packet is sent from the packet buffer without any copy. It costs one check per packet. Every
+// other block goes through the table, since the packet buffer is freed when its handler returns and cannot be
+// kept for the flush. Only levels with a fan-in of 1 gain anything.
+#ifndef FORWARD_WHOLE
+    #define FORWARD_WHOLE 0
+#endif
+
+#if FORWARD_WHOLE && STORAGE_TYPE != STORAGE_TYPE_HASH
+    #error "FORWARD_WHOLE needs STORAGE_TYPE_HASH"
+#endif
+#if FORWARD_WHOLE && TOPK_ELEMENTS > 0
+    #error "FORWARD_WHOLE sends packets as they are, it cannot be combined with TOPK_ELEMENTS"
+#endif
+
+// Cycles after the first packet of a block at which it is flushed with whatever arrived so far (0 waits forever)
+// Slots are only checked by arriving packets, one per packet, so the flush can come later than that.
+#ifndef STRAGGLER_TIMEOUT
+    #define STRAGGLER_TIMEOUT 0
+#endif
+
+#if STRAGGLER_TIMEOUT > 0 && NUM_SWITCH_PORTS > 32
+    #error "STRAGGLER_TIMEOUT supports up to 32 switch ports"
+#endif
+
+// 16 bit port, block_split_num and seq in the header, for more than 255 ports or packets per block and port
+#ifndef WIDE_HEADER
+    #define WIDE_HEADER 0
+#endif
+
+#if WIDE_HEADER
+    #define AR_PORT_NAME uint16_t
+    #define AR_CHUNK_NAME uint16_t // Packet counts and positions within a block
+#else
+    #define AR_PORT_NAME uint8_t
+    #define AR_CHUNK_NAME uint8_t
+#endif
+
+#if NUM_SWITCH_PORTS > 256 && !WIDE_HEADER
+    #error "More than 256 switch ports need WIDE_HEADER"
+#endif
+
+// Most packets a port may split a block in with DROP_DUPLICATES, each one has a bit in the slot
+#ifndef MAX_CHUNKS_PER_PORT
+    #define MAX_CHUNKS_PER_PORT 32
+#endif
+
+#if MAX_CHUNKS_PER_PORT > 256 && !WIDE_HEADER
+    #error "MAX_CHUNKS_PER_PORT above 256 needs WIDE_HEADER"
+#endif
+
+// With PRE_REDUCE each HPU folds its packets into a private table of PRE_REDUCE_LEN indices next to its out buffer,
+// and only takes the slot lock to merge the table when the next packet does not fit or is of another slot. The
+// completion of a block is counted with one atomic word, the handler of its last packet gathers the tables.
+#ifndef PRE_REDUCE
+    #define PRE_REDUCE 0
+#endif
+#ifndef PRE_REDUCE_LEN
+    #define PRE_REDUCE_LEN 1024 // Power of 2, kept at most half full
+#endif
+
+// The duplicate bitmaps take MAX_CHUNKS_PER_PORT bits per port in every slot, so the slot state grows with the fan-in.
+// Opt-in for lossy links: without it a retransmitted packet of an open block is added twice. Pre-reduced packets
+// never take the slot lock the bitmaps need.
+#ifndef DROP_DUPLICATES
+    #define DROP_DUPLICATES 0
+#endif
+
+#define AR_CHUNK_WORDS ((MAX_CHUNKS_PER_PORT + 31) / 32)
+
+// Read the number of children, block range, hash table size and policy flags from an AllreduceConfig the driver
+// writes at the start of the L2 handler memory. The compile-time values become capacities, so one handler build
+// serves a whole sweep. With 0 the compile-time values are used directly.
+#ifndef RUNTIME_CONFIG
+    #define RUNTIME_CONFIG 0
+#endif
+
+// Width of the indices carried by the packets. With INDEX_TYPE_BASE16 a packet holds 16 bit offsets from a
+// 32 bit base, so it only covers a 64K window of the block, but blocks can still be larger than 64K.
+#define INDEX_TYPE_U16 0
+#define INDEX_TYPE_U32 1
+#define INDEX_TYPE_BASE16 2
+
+#ifndef INDEX_TYPE
+#define INDEX_TYPE INDEX_TYPE_U16
+#endif
+
+#if INDEX_TYPE == INDEX_TYPE_U16
+    #define AR_INDEX_NAME uint16_t // Index as sent in the packets
+    #define AR_BLOCK_INDEX_NAME uint16_t // Index within the block
+#elif INDEX_TYPE == INDEX_TYPE_U32
+    #define AR_INDEX_NAME uint32_t
+    #define AR_BLOCK_INDEX_NAME uint32_t
+#elif INDEX_TYPE == INDEX_TYPE_BASE16
+    #define AR_INDEX_NAME uint16_t
+    #define AR_BLOCK_INDEX_NAME uint32_t
+    #define AR_BASE_WINDOW (UINT16_MAX + 1) // Indices of a packet must be in [base, base + AR_BASE_WINDOW)
+#else
+    #error "Unsupported INDEX_TYPE"
+#endif
+
 #define AR_TYPE_INT32 0
 #define AR_TYPE_INT16 1
 #define AR_TYPE_INT8 2
@@ -40,8 +194,17 @@
     #warning "USING HASH TABLE"
 #endif 
 
+#if DENSE_OUTPUT == 1 && VALUES_PER_ELEMENT != 1
+    #error "DENSE_OUTPUT only supports VALUES_PER_ELEMENT == 1"
+#endif
+
+// The dense table keeps a single value per index
+#if STORAGE_TYPE == STORAGE_TYPE_DENSE && VALUES_PER_ELEMENT != 1
+    #error "STORAGE_TYPE_DENSE only supports VALUES_PER_ELEMENT == 1"
+#endif
+
 #if VALUES_PER_ELEMENT == 1
-    // We add  + sizeof(uint16_t) because we have to send the index. Index will be relative to the block
+    // We add  + sizeof(AR_INDEX_NAME) because we have to send the index. Index will be relative to the block
     #if AR_TYPE == AR_TYPE_INT32
         #define AR_TYPE_NAME int32_t
         #define HASH_SIZE 256 //Power of 2 for faster modulo (MAX_DATA_ELEMENTS*1)
@@ -75,7 +238,7 @@
     #endif
 
 #elif VALUES_PER_ELEMENT == 2
-    // We add  + sizeof(uint16_t) because we have to send the index. Index will be relative to the block
+    // We add  + sizeof(AR_INDEX_NAME) because we have to send the index. Index will be relative to the block
     #if AR_TYPE == AR_TYPE_INT32
         #define AR_TYPE_NAME int32_t
         #define HASH_SIZE 128 //Power of 2 for faster modulo (MAX_DATA_ELEMENTS*1)
@@ -111,26 +274,93 @@
     #error "Unsupported VALUES_PER_ELEMENT"
 #endif
 
-#define AR_TYPE_SIZE (VALUES_PER_ELEMENT * sizeof(AR_TYPE_NAME) + sizeof(uint16_t))
+#define AR_TYPE_SIZE (VALUES_PER_ELEMENT * sizeof(AR_TYPE_NAME) + sizeof(AR_INDEX_NAME))
+
+#define AR_PKT_VERSION 4 // Bump whenever the layout of the packets below changes
+#define AR_WORD_SIZE sizeof(uint32_t)
 
+// Padded to a whole number of words: together with the IP/UDP headers, the payload starts word aligned
 typedef struct{
     uint32_t id; // block id
     uint32_t root_address;
     uint16_t num_values; // Number of values set, MORE PRECISELY, NUM_ELEMENTS, WE CAN HAVE SEVERAL VALUES IN AN ELEMENT
-    uint8_t block_split_num; // In how many packets the block has been split. If 0, we don't know it yet
-    uint8_t port;
-}AllreduceHeader; // TODO: What if size non-multiple of 4 and so the data is not 4-bytes aligned?
+    AR_CHUNK_NAME block_split_num; // In how many packets the block has been split. If 0, we don't know it yet
+    AR_PORT_NAME port;
+    uint8_t flags; // AR_FLAG_* bits describing how the payload is encoded
+    uint8_t version; // AR_PKT_VERSION
+    AR_CHUNK_NAME seq; // Position of the packet among the ones its port splits the block in, duplicates have the same
+    uint8_t coll_id; // Collective the block belongs to, must be < NUM_COLLECTIVES
+#if WIDE_HEADER
+    uint8_t reserved;
+#endif
+#if STRAGGLER_TIMEOUT > 0
+    uint32_t children; // With AR_FLAG_PARTIAL, bitmap of the ports whose last packet was in (earlier ones may be late)
+#endif
+}AllreduceHeader;
 
-#define MAX_DATA_ELEMENTS ((PKT_SIZE - SIZE_IP_UDP_HDRS - sizeof(AllreduceHeader)) / AR_TYPE_SIZE)
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+    #define AR_BASE_SIZE sizeof(uint32_t)
+#else
+    #define AR_BASE_SIZE 0
+#endif
+
+// Up to AR_WORD_SIZE - 1 bytes are lost aligning the index array
+#define MAX_DATA_ELEMENTS ((PKT_SIZE - SIZE_IP_UDP_HDRS - sizeof(AllreduceHeader) - AR_BASE_SIZE - (AR_WORD_SIZE - 1)) / AR_TYPE_SIZE)
+
+#define AR_FLAG_DENSE 0x1 // Payload is a contiguous run of values starting at AllreduceDensePacket.start, no index array
+#define AR_FLAG_PARTIAL 0x2 // Block flushed by timeout, the rest of it follows as AR_FLAG_LATE packets
+#define AR_FLAG_LATE 0x4 // Unreduced packet of a block already flushed by timeout, it is just forwarded
+#define AR_FLAG_BCAST 0x8 // Reduced block on its way down the tree, it is replicated to every child port
+#define AR_FLAG_COALESCED 0x10 // Payload is num_values segments, each a whole packet of some block without the IP/UDP headers
+
+// A dense packet only carries the values (plus the offset of the first one), so it fits more elements
+#define MAX_DENSE_DATA_ELEMENTS ((PKT_SIZE - SIZE_IP_UDP_HDRS - sizeof(AllreduceHeader) - sizeof(uint32_t)) / sizeof(AR_TYPE_NAME))
 
 #ifndef BLOCK_TO_NONZERO_RATIO
 #define BLOCK_TO_NONZERO_RATIO 100 // 1 nonzero element every BLOCK_TO_NONZERO_RATIO elements
 #endif
+// Can be overridden to benchmark fewer, larger blocks (beyond 64K it needs INDEX_TYPE_U32 or INDEX_TYPE_BASE16)
+#ifndef BLOCK_RANGE
 #define BLOCK_RANGE ((MAX_DATA_ELEMENTS-SLACK)*BLOCK_TO_NONZERO_RATIO * VALUES_PER_ELEMENT)
+#endif
 
+// With RUNTIME_CONFIG the driver is built with the capacities of the handler, so that both lay out L1 and L2 the
+// same way, and gets the fan-in and sparsity of the run apart. They reach the handler in the AllreduceConfig.
+#ifndef RUN_SWITCH_PORTS
+    #define RUN_SWITCH_PORTS NUM_SWITCH_PORTS
+#endif
+#ifndef RUN_NONZERO_RATIO
+    #define RUN_NONZERO_RATIO BLOCK_TO_NONZERO_RATIO
+#endif
+#if RUN_SWITCH_PORTS > NUM_SWITCH_PORTS || RUN_NONZERO_RATIO > BLOCK_TO_NONZERO_RATIO
+    #error "The run has more ports or sparser blocks than the handler build holds"
+#endif
+// Hash table entries the run uses, the power of 2 the slots index with a mask
+#ifndef RUN_HASH_SIZE
+    #define RUN_HASH_SIZE HASH_SIZE
+#endif
+#if RUN_HASH_SIZE > HASH_SIZE || RUN_HASH_SIZE == 0 || (RUN_HASH_SIZE & (RUN_HASH_SIZE - 1))
+    #error "The hash table of the run must be a power of 2 no larger than the one of the handler build"
+#endif
+#if RUN_NONZERO_RATIO == BLOCK_TO_NONZERO_RATIO
+    #define RUN_BLOCK_RANGE BLOCK_RANGE
+#else
+    #define RUN_BLOCK_RANGE ((MAX_DATA_ELEMENTS-SLACK)*RUN_NONZERO_RATIO * VALUES_PER_ELEMENT)
+#endif
+
+// Above this many nonzeros a flushed block is sent as dense packets. By default it is the point where
+// index+value pairs take more bytes than the plain values of the whole block.
+#ifndef DENSE_OUTPUT_THRESHOLD
+#define DENSE_OUTPUT_THRESHOLD ((RUN_BLOCK_RANGE * sizeof(AR_TYPE_NAME)) / AR_TYPE_SIZE)
+#endif
+
+// Values go first, right after the header, so they are word aligned for every AR_TYPE. The index array follows
+// on the next word boundary.
 typedef struct{
     AllreduceHeader hdr;
-    uint16_t index[MAX_DATA_ELEMENTS];
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+    uint32_t base; // Block index the offsets in index[] are relative to
+#endif
 #if AR_TYPE == AR_TYPE_INT32
     int32_t data[MAX_DATA_ELEMENTS*VALUES_PER_ELEMENT];  
 #elif AR_TYPE == AR_TYPE_INT16
@@ -140,26 +370,211 @@ typedef struct{
 #elif AR_TYPE == AR_TYPE_FLOAT
     float data[MAX_DATA_ELEMENTS*VALUES_PER_ELEMENT];  
 #endif
+    AR_INDEX_NAME index[MAX_DATA_ELEMENTS] __attribute__((aligned(4)));
 }AllreducePacket;
 
 typedef struct{
-    int32_t num_children;
-    uint8_t subblocks_in_expected[NUM_SWITCH_PORTS]; // In how many packets the block has been split
-    uint8_t subblocks_in_recvd[NUM_SWITCH_PORTS]; // In how many packets the block has been split    
+    AllreduceHeader hdr;
+    uint32_t start; // Index (relative to the block) of data[0]
+    AR_TYPE_NAME data[MAX_DENSE_DATA_ELEMENTS];
+}AllreduceDensePacket;
+
+// Packets only carry num_values elements: the indices start right after the first num_values values
+// (rounded up to a word), so a full packet has exactly the AllreducePacket layout
+#define AR_INDEX_OFFSET(n) ((((n) * VALUES_PER_ELEMENT * sizeof(AR_TYPE_NAME) + AR_WORD_SIZE - 1) / AR_WORD_SIZE) * AR_WORD_SIZE)
+#define AR_PKT_INDEX(ar) ((AR_INDEX_NAME*) ((uint8_t*) (ar)->data + AR_INDEX_OFFSET((ar)->hdr.num_values)))
+// Moves the indices written at their full-packet position next to the values, call it once num_values is final
+#define AR_PKT_COMPACT(ar) memmove(AR_PKT_INDEX(ar), (ar)->index, (ar)->hdr.num_values * sizeof(AR_INDEX_NAME))
+#define AR_PKT_LEN(n) (SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader) + AR_BASE_SIZE + AR_INDEX_OFFSET(n) + (n) * sizeof(AR_INDEX_NAME))
+// Index within the block of an index read from the packet
+#if INDEX_TYPE == INDEX_TYPE_BASE16
+    #define AR_BLOCK_INDEX(ar, idx) ((ar)->base + (idx))
+#else
+    #define AR_BLOCK_INDEX(ar, idx) (idx)
+#endif
+#define AR_DENSE_PKT_LEN(n) (SIZE_IP_UDP_HDRS + sizeof(AllreduceHeader) + sizeof(uint32_t) + (n) * sizeof(AR_TYPE_NAME))
+// Bytes a packet with header hdr takes as a segment of an AR_FLAG_COALESCED packet, the next one starts word aligned
+#define AR_SEGMENT_LEN(hdr) (((((hdr)->flags & AR_FLAG_DENSE) ? AR_DENSE_PKT_LEN((hdr)->num_values) : AR_PKT_LEN((hdr)->num_values)) - SIZE_IP_UDP_HDRS + AR_WORD_SIZE - 1) / AR_WORD_SIZE * AR_WORD_SIZE)
+
+#define NIC_PKT_GRANULARITY 64 // The NIC moves packets in 64 bytes units
+#define AR_WIRE_LEN(len) ((((len) + NIC_PKT_GRANULARITY - 1) / NIC_PKT_GRANULARITY) * NIC_PKT_GRANULARITY)
+
+_Static_assert(AR_INDEX_OFFSET(MAX_DATA_ELEMENTS) == offsetof(AllreducePacket, index) - offsetof(AllreducePacket, data), "Compact packet layout does not match AllreducePacket");
+_Static_assert((SIZE_IP_UDP_HDRS + offsetof(AllreducePacket, data)) % AR_WORD_SIZE == 0, "Packet values are not word aligned");
+_Static_assert((SIZE_IP_UDP_HDRS + offsetof(AllreducePacket, index)) % AR_WORD_SIZE == 0, "Packet indices are not word aligned");
+_Static_assert((SIZE_IP_UDP_HDRS + offsetof(AllreduceDensePacket, data)) % AR_WORD_SIZE == 0, "Dense packet values are not word aligned");
+_Static_assert(SIZE_IP_UDP_HDRS + sizeof(AllreducePacket) <= PKT_SIZE, "AllreducePacket does not fit in PKT_SIZE");
+_Static_assert(INDEX_TYPE != INDEX_TYPE_U16 || BLOCK_RANGE <= UINT16_MAX + 1, "BLOCK_RANGE above 64K needs INDEX_TYPE_U32 or INDEX_TYPE_BASE16");
+_Static_assert(RUN_BLOCK_RANGE <= BLOCK_RANGE, "The block of the run is larger than the handler build holds");
+_Static_assert(PKT_SIZE % NIC_PKT_GRANULARITY == 0, "PKT_SIZE must be a multiple of NIC_PKT_GRANULARITY");
+
+#define AR_CONFIG_MAGIC 0x41524346 // Set by the driver once the rest of AllreduceConfig is valid
+
+#define AR_CFG_DENSE_OUTPUT 0x1 // Send blocks above dense_output_threshold nonzeros as dense packets (needs DENSE_OUTPUT)
+#define AR_CFG_DROP_DUPLICATES 0x2 // Check the duplicate bitmaps (needs DROP_DUPLICATES)
+
+typedef struct{
+    uint32_t magic; // AR_CONFIG_MAGIC
+    uint32_t num_children; // <= NUM_SWITCH_PORTS
+    uint32_t block_range; // <= BLOCK_RANGE
+    uint32_t hash_size; // Power of 2, <= HASH_SIZE
+    uint32_t dense_output_threshold;
+    uint32_t flags; // AR_CFG_* bits
+}AllreduceConfig;
+
+// Stash packets are sent straight from the slot, so they keep room for the IP/UDP headers in front
+typedef struct{
+    uint8_t ip_udp_hdrs[SIZE_IP_UDP_HDRS];
+    AllreducePacket pkt;
+}AllreduceFrame;
+
+// The HPU completing a block only queues it, its chunks of FLUSH_CHUNK indices are then sent by whichever
+// handlers of the cluster are about to return, so no single packet pays for the whole flush
+#ifndef DEFERRED_FLUSH
+    #define DEFERRED_FLUSH 0
+#endif
+
+// Ports send the packets of a block in ascending index order, so once a port's packets up to its highest seq
+// are in, the indices below the end of that packet are final for it. STREAM_FLUSH sends the indices that are
+// final for every port while the block is still arriving, at least STREAM_FLUSH_MIN of them at a time.
+#ifndef STREAM_FLUSH
+    #define STREAM_FLUSH 0
+#endif
+#ifndef STREAM_FLUSH_MIN
+    #define STREAM_FLUSH_MIN ((BLOCK_RANGE + 7) / 8)
+#endif
+
+typedef struct{
+    uint32_t recvd; // Packets of the block from the port
+    uint32_t top; // Highest seq among them + 1
+    uint32_t top_end; // End of the indices of that packet, the block range for the last packet of the port
+    uint32_t high_water; // Indices below it are final for the port
+}PortStream;
+
+// COALESCE_OUTPUT packs the outgoing packets of up to COALESCE_MAX_LEN bytes (the tails of the blocks at high
+// sparsity) of a cluster into shared AR_FLAG_COALESCED packets. One is sent once the next packet does not fit,
+// COALESCE_TIMEOUT cycles after its first packet went in, or when no other block of the cluster is open.
+// Only for the level that sends to a host: handlers drop AR_FLAG_COALESCED packets as malformed, the driver
+// replay unpacks them so that every block of the level above keeps its own message.
+#ifndef COALESCE_OUTPUT
+    #define COALESCE_OUTPUT 0
+#endif
+#ifndef COALESCE_MAX_LEN
+    #define COALESCE_MAX_LEN (PKT_SIZE / 2)
+#endif
+#ifndef COALESCE_TIMEOUT
+    #define COALESCE_TIMEOUT 2000
+#endif
+
+typedef struct{
+    uint32_t lock;
+    uint32_t open; // Blocks of the cluster with packets in that did not flush yet
+    uint32_t len; // Bytes of frame used, 0 while nothing waits
+    uint32_t first; // Cycle at which the first packet went in
+    uint8_t frame[PKT_SIZE] __attribute__((aligned(4)));
+}Coalescer;
+
+// With CLUSTER_SPLIT the slots of a block in the 4 clusters share a count in L2, so that the block leaves
+// with one closing packet like an unsplit one. Like the slots, it holds one block at a time.
+typedef struct{
+    uint32_t sent; // Packets the slices flushed so far sent
+    uint32_t slices; // Slices flushed so far
+}SliceCount;
+
+// Broadcast phase of the allreduce. With BCAST_FORWARD packets flagged AR_FLAG_BCAST are replicated to all the
+// children, with BCAST_ROOT the switch is also the root and sends every reduced block down instead of up.
+#define BCAST_NONE 0
+#define BCAST_FORWARD 1
+#define BCAST_ROOT 2
+
+#ifndef BCAST
+    #define BCAST BCAST_NONE
+#endif
+
+#define AR_OUT_BUFFERS 8 // One per HPU of a cluster
+
+#define AR_PRE_REDUCE_FILL (PRE_REDUCE_LEN / 2)
+// A port that sent its last packet adds 1 << AR_PRE_CHILD_SHIFT to the completion word of the slot, and every
+// packet adds the packets it announces (block_split_num) minus itself. The block is complete once the word is
+// exactly AR_CHILDREN << AR_PRE_CHILD_SHIFT.
+#define AR_PRE_CHILD_SHIFT 20
+
+typedef struct{
+    uint32_t lock; // Taken by its HPU to fold a packet in, and by whoever merges the table into the slot
+    uint32_t offset; // Slot of the block the values belong to
+    uint32_t n; // Indices held
+    uint32_t key[PRE_REDUCE_LEN]; // Block index + 1, 0 for a free entry
+    AR_TYPE_NAME data[PRE_REDUCE_LEN];
+}PreBuffer;
+
+// With MAILBOX_BATCH a handler that finds the slot locked leaves its packet in the mailbox of the slot and waits
+// for the holder of the lock to handle it, so under incast one lock round trip serves several packets
+#ifndef MAILBOX_BATCH
+    #define MAILBOX_BATCH 0
+#endif
+
+typedef struct{
+    // Completion is tracked with totals, so it takes the same space for any number of ports: the block is
+    // complete once every port sent its last packet (carrying block_split_num) and all the packets are in
+    int32_t num_children; // Ports whose last packet arrived
+    uint32_t subblocks_in_expected; // Sum of the block_split_num of those ports
+    uint32_t subblocks_in_recvd; // Packets counted so far, from any port
+#if DROP_DUPLICATES
+    uint32_t chunks_recvd[NUM_SWITCH_PORTS][AR_CHUNK_WORDS]; // Bitmap of the seq received from each port
+#endif
+    uint32_t next_id; // Blocks below it were already flushed from this slot, their packets are duplicates
+    uint8_t coll_id; // Collective of the block, copied to the packets the slot sends
+#if CLUSTER_SPLIT
+    uint8_t slice; // Of every block, the one of the cluster of the slot
+    volatile SliceCount* slice_count; // Of the block, set by every packet so the flush can reach it
+#endif
+#if RUNTIME_CONFIG
+    AllreduceConfig cfg; // Copy of the configuration in L2, made by the first packet that uses the slot
+#endif
+#if STRAGGLER_TIMEOUT > 0
+    uint32_t id; // Block aggregated in the slot
+    uint32_t first_arrival; // Cycle at which its first packet was counted, 0 while the slot is idle
+    uint32_t children_done; // Bitmap of the ports whose last packet arrived
+    uint32_t partial_id; // Last block flushed by timeout from this slot (+1, 0 if none), its late packets are forwarded
+#endif
+#if DEFERRED_FLUSH
+    uint32_t flush_pending; // The queued block is not out yet, the slot cannot take values
+    uint32_t flush_id; // Queued block
+    uint32_t flush_next; // Queue entry of it (high bits) and next chunk to hand out (low bits)
+    uint32_t flush_done; // Chunks sent
+    uint32_t flush_sent; // Packets they were sent in, each takes its seq from it
+#endif
+#if STREAM_FLUSH
+    uint32_t stream_flushed; // Indices below it were already sent
+    uint32_t stream_sent; // Packets they were sent in
+    PortStream stream[NUM_SWITCH_PORTS];
+#endif
+#if COALESCE_OUTPUT
+    volatile Coalescer* coalescer; // Of the cluster, set by every packet so the flush paths can reach it
+#endif
+#if PRE_REDUCE
+    uint32_t pre_pending; // Completion word, see AR_PRE_CHILD_SHIFT
+#endif
+#if MAILBOX_BATCH
+    volatile uint32_t mailbox[AR_OUT_BUFFERS]; // Packet left by each HPU of the cluster, cleared once it was handled
+#endif
 #if STORAGE_TYPE == STORAGE_TYPE_DENSE
     #if AR_TYPE == AR_TYPE_INT32
-        int32_t data[BLOCK_RANGE];  
+        int32_t data[AR_SLOT_RANGE];  
     #elif AR_TYPE == AR_TYPE_INT16
-        int16_t data[BLOCK_RANGE];
+        int16_t data[AR_SLOT_RANGE];
     #elif AR_TYPE == AR_TYPE_INT8
-        int8_t data[BLOCK_RANGE];
+        int8_t data[AR_SLOT_RANGE];
     #elif AR_TYPE == AR_TYPE_FLOAT
-        float data[BLOCK_RANGE];  
+        float data[AR_SLOT_RANGE];  
     #endif
 #elif STORAGE_TYPE == STORAGE_TYPE_HASH
-    uint8_t subblocks_out_sent; // In how many packets the block has been split
-    AllreducePacket stash;
-    uint16_t index[HASH_SIZE];
+    AR_CHUNK_NAME subblocks_out_sent; // In how many packets the block has been split
+    AllreduceFrame stash;
+#if TOPK_ELEMENTS > 0
+    uint32_t topk_stashed; // Collisions of the block that already left through the stash
+#endif
+    AR_BLOCK_INDEX_NAME index[HASH_SIZE];
     #if AR_TYPE == AR_TYPE_INT32
         int32_t data[HASH_SIZE*VALUES_PER_ELEMENT];  
     #elif AR_TYPE == AR_TYPE_INT16
@@ -171,3 +586,232 @@ typedef struct{
     #endif
 #endif
 }AllreduceInfo;
+
+// Sizes of the memories the driver sets up for the handlers
+#ifndef NUM_CLUSTERS
+    #define NUM_CLUSTERS 4 // The driver has it from pspinsim.h
+#endif
+#ifndef SCRATCHPAD_SIZE
+    #define SCRATCHPAD_SIZE (800 * 1024) // Per cluster
+#endif
+#ifndef NIC_L2_SIZE
+    #define NIC_L2_SIZE (1024 * 1024) // Handler L2 memory, shared by the clusters
+#endif
+
+
+#if STRAGGLER_TIMEOUT > 0
+    #define SWEEP_CURSOR_SIZE sizeof(uint32_t) // Round robin cursor of straggler_sweep, between the out buffers and the slots
+#else
+    #define SWEEP_CURSOR_SIZE 0
+#endif
+
+#if DEFERRED_FLUSH
+// Indices per chunk of a queued block, by default one chunk per HPU of the cluster
+#ifndef FLUSH_CHUNK
+    #define FLUSH_CHUNK ((BLOCK_RANGE + AR_OUT_BUFFERS - 1) / AR_OUT_BUFFERS)
+#endif
+// A slot queues one block at a time. An HPU may have sent the last chunk of a block but not yet moved the head
+// past it when the slot queues its next block, so each HPU can hold one more entry.
+#define AR_FLUSH_QUEUE_LEN (NUM_MAX_FLYING_PACKETS + AR_OUT_BUFFERS)
+// flush_next packs the queue entry with the chunk counter, so one amo_add tells a claimer both which block the
+// chunk is from and whether the slot still holds the block of the entry it came from
+#define AR_FLUSH_CHUNK_BITS 20
+#define AR_FLUSH_CLAIM_TAG(entry) ((uint32_t) (entry) << AR_FLUSH_CHUNK_BITS)
+#define AR_FLUSH_CLAIM_CHUNK(claim) ((claim) & ((1 << AR_FLUSH_CHUNK_BITS) - 1))
+// Late claims push the counter past the last chunk, at most once per HPU and queue entry it reads the slot from
+_Static_assert((BLOCK_RANGE + FLUSH_CHUNK - 1) / FLUSH_CHUNK + AR_OUT_BUFFERS * AR_FLUSH_QUEUE_LEN < (1 << AR_FLUSH_CHUNK_BITS), "Too many chunks per block for the claim word of DEFERRED_FLUSH, raise FLUSH_CHUNK");
+
+// Lock-free ring of the blocks waiting to be flushed by the handlers of a cluster
+typedef struct{
+    uint32_t head; // Oldest entry that may still have chunks to hand out
+    uint32_t tail; // Next entry to fill
+    uint32_t seq[AR_FLUSH_QUEUE_LEN]; // Entry i is published once seq[i % AR_FLUSH_QUEUE_LEN] == i + 1
+    uint32_t offset[AR_FLUSH_QUEUE_LEN]; // Slot of the queued block
+}FlushQueue;
+    #define FLUSH_QUEUE_SIZE sizeof(FlushQueue)
+#else
+    #define FLUSH_QUEUE_SIZE 0
+#endif
+
+#define COALESCER_SIZE (COALESCE_OUTPUT ? sizeof(Coalescer) : 0)
+#define PRE_REDUCE_SIZE (PRE_REDUCE ? sizeof(PreBuffer)*AR_OUT_BUFFERS : 0)
+
+// The L1 of a cluster is word interleaved over TCDM_BANKS banks
+#ifndef TCDM_BANKS
+    #define TCDM_BANKS 32
+#endif
+
+// Words from one slot lock to the next. With 1 the locks are packed; a larger stride puts locks that are
+// polled at the same time further apart, e.g. TCDM_BANKS+1 keeps them in distinct banks and off the lines
+// of the neighbouring locks.
+#ifndef LOCK_STRIDE
+    #define LOCK_STRIDE 1
+#endif
+
+// Padding words after each slot, to shift where the counters at the start of consecutive slots fall
+#ifndef SLOT_PAD
+    #define SLOT_PAD 0
+#endif
+
+// L1 of each cluster: slot locks | one out buffer per HPU | one pre-reduction table per HPU | sweep cursor |
+// flush queue | coalescer | the first AR_L1_SLOTS slots
+#define AR_L1_LOCKS_OFF 0
+#define AR_L1_OUT_OFF (AR_L1_LOCKS_OFF + sizeof(uint32_t)*LOCK_STRIDE*NUM_MAX_FLYING_PACKETS)
+#define AR_L1_PRE_OFF (AR_L1_OUT_OFF + PKT_SIZE*AR_OUT_BUFFERS)
+#define AR_L1_CURSOR_OFF (AR_L1_PRE_OFF + PRE_REDUCE_SIZE)
+#define AR_L1_QUEUE_OFF (AR_L1_CURSOR_OFF + SWEEP_CURSOR_SIZE)
+#define AR_L1_COALESCE_OFF (AR_L1_QUEUE_OFF + FLUSH_QUEUE_SIZE)
+#define AR_L1_HEAD (AR_L1_COALESCE_OFF + COALESCER_SIZE)
+#define AR_SLOT_STRIDE (sizeof(AllreduceInfo) + sizeof(uint32_t)*SLOT_PAD)
+
+#define AR_L1_LOCK(local_mem, offset) ((volatile uint32_t*) ((local_mem) + AR_L1_LOCKS_OFF + sizeof(uint32_t)*LOCK_STRIDE*(offset)))
+#define AR_L1_OUT_BUFFER(local_mem, hpu_id) ((volatile int8_t*) ((local_mem) + AR_L1_OUT_OFF + PKT_SIZE*(hpu_id)))
+#define AR_L1_PRE(local_mem, hpu_id) ((volatile PreBuffer*) ((local_mem) + AR_L1_PRE_OFF + sizeof(PreBuffer)*(hpu_id)))
+#define AR_L1_CURSOR(local_mem) ((volatile uint32_t*) ((local_mem) + AR_L1_CURSOR_OFF))
+#define AR_L1_QUEUE(local_mem) ((volatile FlushQueue*) ((local_mem) + AR_L1_QUEUE_OFF))
+#define AR_L1_COALESCER(local_mem) ((volatile Coalescer*) ((local_mem) + AR_L1_COALESCE_OFF))
+
+// Slots of each cluster kept in L1, the others spill to the L2 handler memory. By default as many as fit.
+// The split is static: slot offsets below AR_L1_SLOTS are in L1 and the rest in L2, however busy they are.
+#ifndef L1_SLOTS
+    #define L1_SLOTS ((SCRATCHPAD_SIZE - AR_L1_HEAD) / AR_SLOT_STRIDE)
+#endif
+#define AR_L1_SLOTS (L1_SLOTS < NUM_MAX_FLYING_PACKETS ? L1_SLOTS : NUM_MAX_FLYING_PACKETS)
+#define AR_L2_SLOTS (NUM_MAX_FLYING_PACKETS - AR_L1_SLOTS) // Per cluster
+
+// Count the packets of each cluster and how many of them used an L2 slot, and DMA the counters to the
+// host at every flush so that the driver can print them
+#ifndef AR_STATS
+    #define AR_STATS 0
+#endif
+
+typedef struct{
+    uint32_t pkts; // Packets handled by the cluster
+    uint32_t l2_pkts; // Of those, packets whose slot is in L2
+    uint32_t flushes; // Blocks sent out
+    uint32_t batched; // Packets handled from the mailbox of their slot by another handler
+    uint32_t merges; // Pre-reduction tables merged into their slot
+    uint32_t malformed; // Packets dropped for a port or seq out of range
+}AllreduceStats;
+
+// With PHASE_CYCLES every HPU adds up the cycles its handlers spend waiting for slot locks, aggregating values,
+// on bookkeeping (slot lookup, duplicate checks, completion counts) and flushing blocks. Each handler DMAs the
+// counters of its HPU to the host when it is done, so the driver can print them at the end.
+#ifndef PHASE_CYCLES
+    #define PHASE_CYCLES 0
+#endif
+
+#define PHASE_LOCK 0
+#define PHASE_AGGREGATE 1
+#define PHASE_BOOKKEEPING 2
+#define PHASE_FLUSH 3
+#define AR_PHASES 4
+
+typedef struct{
+    uint32_t last; // Cycle of the last phase change of the handler running on the HPU
+    uint32_t pkts; // Handlers run by the HPU
+    uint32_t cycles[AR_PHASES];
+}PhaseCycles;
+
+#define AR_CYCLES_HOST_OFFSET 1024 // Above the stats in host memory, HPU h of cluster c at index c*AR_OUT_BUFFERS + h
+
+// L2 handler memory: configuration | stats of each cluster | cycles of each HPU | slice counts | L2 slots of
+// cluster 0 | of cluster 1 | ...
+#define AR_L2_CONFIG_SIZE (RUNTIME_CONFIG ? sizeof(AllreduceConfig) : 0)
+#define AR_L2_STATS_SIZE (AR_STATS ? sizeof(AllreduceStats)*NUM_CLUSTERS : 0)
+#define AR_L2_CYCLES_SIZE (PHASE_CYCLES ? sizeof(PhaseCycles)*NUM_CLUSTERS*AR_OUT_BUFFERS : 0)
+#define AR_L2_SLICES_SIZE (CLUSTER_SPLIT ? sizeof(SliceCount)*NUM_MAX_FLYING_PACKETS : 0)
+#define AR_L2_HEAD ((AR_L2_CONFIG_SIZE + AR_L2_STATS_SIZE + AR_L2_CYCLES_SIZE + AR_L2_SLICES_SIZE + 7) & ~7)
+
+_Static_assert(AR_L1_HEAD + AR_SLOT_STRIDE*AR_L1_SLOTS <= SCRATCHPAD_SIZE, "Locks, out buffers and L1_SLOTS slots do not fit in SCRATCHPAD_SIZE");
+_Static_assert(AR_L2_HEAD + AR_SLOT_STRIDE*AR_L2_SLOTS*NUM_CLUSTERS <= NIC_L2_SIZE, "The slots spilled past L1_SLOTS do not fit in NIC_L2_SIZE");
+
+// At the root of the tree a complete block is written to the host buffer of its collective with DMA instead of
+// being sent as packets: block id goes to root_address + id * block bytes of host memory.
+#ifndef ROOT_MODE
+    #define ROOT_MODE 0
+#endif
+
+#if ROOT_MODE && STORAGE_TYPE != STORAGE_TYPE_DENSE
+    #error "ROOT_MODE needs STORAGE_TYPE_DENSE, the hash table holds no dense image of the block"
+#endif
+#if ROOT_MODE && STRAGGLER_TIMEOUT > 0
+    #error "ROOT_MODE has no parent to forward late packets to"
+#endif
+#if ROOT_MODE && TOPK_ELEMENTS > 0
+    #error "ROOT_MODE writes whole blocks, the top-k selection only applies to packets sent up the tree"
+#endif
+
+#define AR_ROOT_BLOCK_BYTES (RUN_BLOCK_RANGE * sizeof(AR_TYPE_NAME))
+#define AR_ROOT_HOST_OFFSET 4096 // The driver puts the root buffers above the stats in host memory
+
+#if BCAST == BCAST_ROOT && ROOT_MODE
+    #error "BCAST_ROOT sends the reduced blocks to the children, ROOT_MODE writes them to the host"
+#endif
+#if BCAST == BCAST_ROOT && STRAGGLER_TIMEOUT > 0
+    #error "BCAST_ROOT has no parent to forward late packets to"
+#endif
+
+// Reduce-scatter: index range p of AR_CHILDREN equal shards of the block is only sent to port p, which the
+// header port field of the output packets names. Each shard is closed by its own block_split_num.
+#ifndef REDUCE_SCATTER
+    #define REDUCE_SCATTER 0
+#endif
+
+#if REDUCE_SCATTER && STORAGE_TYPE != STORAGE_TYPE_DENSE
+    #error "REDUCE_SCATTER needs STORAGE_TYPE_DENSE, the hash table is not ordered by index"
+#endif
+#if REDUCE_SCATTER && (ROOT_MODE || BCAST == BCAST_ROOT)
+    #error "REDUCE_SCATTER sends each shard to its port, the whole block never reaches the host or all the children"
+#endif
+#if REDUCE_SCATTER && STRAGGLER_TIMEOUT > 0
+    #error "REDUCE_SCATTER cannot send late packets to the owner of their indices"
+#endif
+
+#if DEFERRED_FLUSH && STORAGE_TYPE != STORAGE_TYPE_DENSE
+    #error "DEFERRED_FLUSH needs STORAGE_TYPE_DENSE, the hash table flushes through the single stash of the slot"
+#endif
+#if DEFERRED_FLUSH && (DENSE_OUTPUT || TOPK_ELEMENTS > 0)
+    #error "DEFERRED_FLUSH sends chunks independently, DENSE_OUTPUT and TOPK_ELEMENTS decide over the whole block"
+#endif
+#if DEFERRED_FLUSH && (REDUCE_SCATTER || ROOT_MODE || STRAGGLER_TIMEOUT > 0)
+    #error "DEFERRED_FLUSH only supports the plain flush of the block to the next level"
+#endif
+
+#if STREAM_FLUSH && STORAGE_TYPE != STORAGE_TYPE_DENSE
+    #error "STREAM_FLUSH needs STORAGE_TYPE_DENSE, the hash table is not ordered by index"
+#endif
+#if STREAM_FLUSH && (DENSE_OUTPUT || TOPK_ELEMENTS > 0)
+    #error "STREAM_FLUSH sends ranges before the block is complete, DENSE_OUTPUT and TOPK_ELEMENTS decide over the whole block"
+#endif
+#if STREAM_FLUSH && (DEFERRED_FLUSH || REDUCE_SCATTER || ROOT_MODE || STRAGGLER_TIMEOUT > 0)
+    #error "STREAM_FLUSH only supports the plain flush of the block to the next level"
+#endif
+
+#if COALESCE_OUTPUT && (BCAST != BCAST_NONE || REDUCE_SCATTER || STRAGGLER_TIMEOUT > 0)
+    #error "COALESCE_OUTPUT needs the packets of all the blocks to leave through the same port, and every block to flush once"
+#endif
+#if MAILBOX_BATCH && (DEFERRED_FLUSH || STRAGGLER_TIMEOUT > 0)
+    #error "MAILBOX_BATCH handles packets of other handlers under the slot lock, which the deferred flush and the straggler timeout release on the way"
+#endif
+#if MAILBOX_BATCH && FORWARD_WHOLE && COALESCE_OUTPUT
+    #error "MAILBOX_BATCH waits for a forwarded packet to leave the buffer of its handler, COALESCE_OUTPUT gives no handle for a packet it only copied"
+#endif
+#if PRE_REDUCE && (STORAGE_TYPE != STORAGE_TYPE_DENSE || DROP_DUPLICATES)
+    #error "PRE_REDUCE needs STORAGE_TYPE_DENSE and DROP_DUPLICATES == 0"
+#endif
+#if PRE_REDUCE && (DEFERRED_FLUSH || STREAM_FLUSH || STRAGGLER_TIMEOUT > 0 || MAILBOX_BATCH)
+    #error "PRE_REDUCE counts packets without the slot lock, which the deferred, streaming and timeout flushes and MAILBOX_BATCH need"
+#endif
+#if CLUSTER_SPLIT && STORAGE_TYPE != STORAGE_TYPE_DENSE
+    #error "CLUSTER_SPLIT needs STORAGE_TYPE_DENSE, the array of the slot is what it cuts down to the slice"
+#endif
+#if CLUSTER_SPLIT && (DENSE_OUTPUT || TOPK_ELEMENTS > 0)
+    #error "CLUSTER_SPLIT flushes every slice on its own, DENSE_OUTPUT and TOPK_ELEMENTS decide over the whole block"
+#endif
+#if CLUSTER_SPLIT && (REDUCE_SCATTER || DEFERRED_FLUSH || STREAM_FLUSH || STRAGGLER_TIMEOUT > 0)
+    #error "CLUSTER_SPLIT only supports the plain flush of the slice to the next level or to the host"
+#endif
+_Static_assert(!PRE_REDUCE || (PRE_REDUCE_LEN & (PRE_REDUCE_LEN - 1)) == 0, "PRE_REDUCE_LEN must be a power of 2");
+_Static_assert(!PRE_REDUCE || (MAX_DATA_ELEMENTS <= AR_PRE_REDUCE_FILL && (!DENSE_OUTPUT || MAX_DENSE_DATA_ELEMENTS <= AR_PRE_REDUCE_FILL)), "A packet does not fit in half of PRE_REDUCE_LEN");
+_Static_assert(!PRE_REDUCE || NUM_CHILDREN < (1u << (32 - AR_PRE_CHILD_SHIFT)), "Too many children for the completion word of PRE_REDUCE");
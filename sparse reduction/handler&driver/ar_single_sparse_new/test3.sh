@@ -7,10 +7,21 @@ STORAGETYPES=("array" "hash")
 echo "Hosts Blocks Datatype Solution Storage Sparsity Streams InPkts InBytes InAvgPktLen FeedbackThroughput FeedbackArrival PktAvgLat PktMinLat PktMaxLat HERstalls Commands OutPkts OutBytes OutAvgPktLen PktThroughput PktDepTime" > result.csv
 
 
+# Hash slots do not depend on the sparsity, the handler is built once with runtime_config=1 for the largest fan-in and
+# sparsity of the sweep and only the driver is rebuilt per point. Dense slots are sized by the block, so the array
+# sweeps keep one handler build per point.
 for dtype in 1 2 3; do
-    for sparse in 2 8; do
-        for storage in 0 1; do
-            make deploy driver -j ALLREDUCE_FLAGS="-DAR_TYPE=${dtype} -DSTORAGE_TYPE=${storage} -DBLOCK_TO_NONZERO_RATIO=${sparse} -DNUM_SWITCH_PORTS=16 -DNUM_BLOCKS=32 -DNUM_STREAMS=1"
+    for storage in 0 1; do
+        HASH_VARS="runtime_config=1 DATA_TYPE=${dtype} STORE_TYPE=1 hosts=16 blocks=32 streams=1 max_hosts=16 max_ratio=8"
+        if [ $storage -eq 1 ]; then
+            make deploy -j $HASH_VARS
+        fi
+        for sparse in 2 8; do
+            if [ $storage -eq 1 ]; then
+                make driver -j $HASH_VARS SPARSE_RATIO=${sparse}
+            else
+                make deploy driver -j ALLREDUCE_FLAGS="-DAR_TYPE=${dtype} -DSTORAGE_TYPE=${storage} -DBLOCK_TO_NONZERO_RATIO=${sparse} -DNUM_SWITCH_PORTS=16 -DNUM_BLOCKS=32 -DNUM_STREAMS=1"
+            fi
             echo 16 32 ${DATATYPES[${dtype}]} "ar_single_sparse" ${STORAGETYPES[${storage}]} $sparse 1
             ./sim_ar_single_sparse > transcript
             target=$(cat transcript | tail -20 | head -12 | grep -Eo '[0-9\.]+' | tr "\n" " ")
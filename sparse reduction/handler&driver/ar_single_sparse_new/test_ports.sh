@@ -0,0 +1,15 @@
+#!/bin/bash
+
+# Fan-in sweep: L1 footprint of the handler state and throughput as the number of switch ports grows
+echo "Hosts Blocks Datatype Solution Storage Sparsity DropDuplicates L1Footprint InPkts InBytes InAvgPktLen FeedbackThroughput FeedbackArrival PktAvgLat PktMinLat PktMaxLat HERstalls Commands OutPkts OutBytes OutAvgPktLen PktThroughput PktDepTime" > result.csv
+
+for hosts in 16 64 256 512 1024; do
+    for dedup in 0 1; do
+        make deploy driver -j ALLREDUCE_FLAGS="-DAR_TYPE=0 -DSTORAGE_TYPE=1 -DBLOCK_TO_NONZERO_RATIO=8 -DNUM_SWITCH_PORTS=${hosts} -DNUM_BLOCKS=16 -DNUM_STREAMS=1 -DWIDE_HEADER=1 -DDROP_DUPLICATES=${dedup}"
+        echo $hosts 16 "int32 ar_single_sparse hash" 8 $dedup
+        ./sim_ar_single_sparse > transcript
+        footprint=$(grep "L1 footprint" transcript | grep -Eo '[0-9]+' | head -1)
+        target=$(cat transcript | tail -20 | head -12 | grep -Eo '[0-9\.]+' | tr "\n" " ")
+        echo $hosts 16 "int32 ar_single_sparse hash" 8 $dedup $footprint $target  >> result.csv
+    done
+done